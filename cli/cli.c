@@ -15,10 +15,12 @@
 
 #define AUTOBOOT_FILENAME "boot"
 #define AUTOBOOT_TIMEOUT_MS 500 /* this is actually enough as you can pre-stuff the UART receiver */
+#define NETBOOT_DHCP_TIMEOUT 10 /* seconds to wait for a DHCP lease when there is no boot script */
 
 #define MAXARG 40
 #define LINELEN 2048
 char *cmd_buffer;
+bool cli_background = false;
 
 static void execute_cmd(char *linebuffer);
 static void handle_any_command(char *argv[], int argc);
@@ -54,15 +56,24 @@ const cmd_entry_t builtin_cmd_table[] = {
     /* -- cli_info.c ------------------- */
     /* name         min     max function */
     {"meminfo",    0,      0,   &do_meminfo,  "info on memory state" },
-    {"netinfo",     0,      0,  &do_netinfo,  "network statistics" },
+    {"netinfo",     0,      1,  &do_netinfo,  "network statistics [reset]" },
+    {"ethbuf",      0,      1,  &do_ethbuf,   "show or set ethernet card Tx slots [count]" },
+    {"netconsole",  0,      2,  &do_netconsole, "console over UDP [ip[:port] [only]|off]" },
+    {"jobs",        0,      0,  &do_jobs,     "list background jobs (commands ending in &)" },
+    {"wait",        0,      1,  &do_wait,     "wait for background jobs to finish [job]" },
     {"help",        0,      0,  &help,        "list this help info"   },
     {"date",        0,      0,  &do_date,     "display date from RTC"   },
 
     /* -- cli_tftp.c ------------------- */
     /* name         min     max function */
-    {"tftp",        1,      3,  &do_tftp_get, "retrieve file with TFTP" },
-    {"tftpget",     1,      3,  &do_tftp_get, "retrieve file with TFTP" },
-    {"tftpput",     1,      3,  &do_tftp_put, "send file with TFTP" },
+    {"tftp",        1,      3,  &do_tftp_get, "retrieve file with TFTP (to disk or @address) [&]", true },
+    {"tftpget",     1,      3,  &do_tftp_get, "retrieve file with TFTP (to disk or @address) [&]", true },
+    {"tftpput",     1,      4,  &do_tftp_put, "send file (or @address length) with TFTP [&]", true },
+    {"tftpmc",      1,      3,  &do_tftp_multicast_get, "retrieve file with multicast TFTP (RFC 2090) [&]", true },
+    {"tftpmget",    1, MAXARG,  &do_tftp_multi_get, "retrieve several files at once with TFTP [ip] file[=local|=@address]..." },
+    {"tftpboot",    1, MAXARG,  &do_tftpboot, "boot ELF file direct from TFTP to memory" },
+    {"tftpd",       0,      1,  &do_tftpd,    "TFTP server for disk files and mem/addr/len [on|off]" },
+    {"http",        3,      3,  &do_http,     "get URL file|@address: retrieve file with HTTP" },
 
     /* -- cli_load.c ------------------- */
     /* name         min     max function */
@@ -156,11 +167,23 @@ static bool handle_cmd_drive(char *arg[], int numarg)
 
 static bool handle_cmd_table(char *arg[], int numarg, const cmd_entry_t *cmd)
 {
+    bool background = false;
+
     while(cmd->name){
         if(!strcasecmp(arg[0], cmd->name)){
+            if(numarg > 1 && !strcmp(arg[numarg-1], "&")){
+                if(!cmd->background){
+                    printf("%s: cannot run in the background\n", arg[0]);
+                    return true;
+                }
+                background = true;
+                numarg--;
+            }
             if((numarg-1) >= cmd->min_args && 
                     (cmd->max_args == 0 || (numarg-1) <= cmd->max_args)){
+                cli_background = background;
                 cmd->function(arg+1, numarg-1);
+                cli_background = false;
             }else{
                 if(cmd->min_args == cmd->max_args){
                     printf("%s: takes exactly %d argument%s\n", arg[0], cmd->min_args, cmd->min_args == 1 ? "" : "s");
@@ -371,29 +394,71 @@ static int getline(char *line, int linesize)
     return k;
 }
 
+// returns false if the user cancelled
+static bool autoboot_wait(timer_t timer, bool (*done)(void))
+{
+    while(!timer_expired(timer) && !(done && done())){
+        net_pump();
+        if(uart_check_cancel_key()){
+            printf("(cancelled)\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+// no boot script: load the file named by DHCP/BOOTP straight into memory
+static void run_netboot(void)
+{
+    const char *bootfile;
+    char *argv[1];
+
+    if(!dhcp_running())
+        return;
+
+    if(!dhcp_bound()){
+        printf("Waiting for DHCP (hit Q to cancel)\n");
+        if(!autoboot_wait(set_timer_sec(NETBOOT_DHCP_TIMEOUT), dhcp_bound))
+            return;
+        if(!dhcp_bound()){
+            printf("No DHCP lease\n");
+            return;
+        }
+    }
+
+    bootfile = get_environment_variable("bootfile");
+    if(!bootfile){
+        printf("No boot file offered by DHCP\n");
+        return;
+    }
+
+    printf("Booting \"%s\" from TFTP server %s (hit Q to cancel)\n", bootfile,
+            get_environment_variable("tftp_server") ? get_environment_variable("tftp_server") : "(none)");
+    if(!autoboot_wait(set_timer_ms(AUTOBOOT_TIMEOUT_MS), NULL))
+        return;
+
+    strcpy(cmd_buffer, bootfile);
+    argv[0] = cmd_buffer;
+    do_tftpboot(argv, 1);
+}
+
 static void run_autoexec(const char *filename)
 {
     FRESULT fr;
     FIL fd;
-    timer_t timer;
 
     fr = f_open(&fd, filename, FA_READ);
     if(fr == FR_OK){
         f_close(&fd);
     }else{
         printf("No \"%s\" script: %s\n", filename, f_errmsg(fr));
-        return; // nothing found
+        run_netboot();
+        return;
     }
 
-    timer = set_timer_ms(AUTOBOOT_TIMEOUT_MS);
     printf("Booting from \"%s\" (hit Q to cancel)\n", filename);
-    while(!timer_expired(timer)){
-        net_pump();
-        if(uart_check_cancel_key()){
-            printf("(cancelled)\n");
-            return;
-        }
-    }
+    if(!autoboot_wait(set_timer_ms(AUTOBOOT_TIMEOUT_MS), NULL))
+        return;
 
     strcpy(cmd_buffer, filename);
     execute_cmd(cmd_buffer);
@@ -0,0 +1,25 @@
+/* Copyright (C) 2023 William R. Sowerbutts */
+
+#include <types.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <cli.h>
+#include <net.h>
+#include <init.h>
+
+void do_http(char *argv[], int argc)
+{
+    uint32_t address;
+
+    if(strcasecmp(argv[0], "get") != 0){
+        printf("http: unknown operation \"%s\" (try \"http get URL file|@address\")\n", argv[0]);
+        return;
+    }
+
+    if(argv[2][0] == '@'){
+        // allow the file to fill all free memory above the target address
+        address = parse_uint32(argv[2]+1, NULL);
+        http_get_memory(argv[1], address, free_memory_above(address));
+    }else
+        http_get(argv[1], argv[2]);
+}
@@ -7,6 +7,7 @@
 #include <init.h>
 #include <tinyalloc.h>
 #include <rtc.h>
+#include <task.h>
 
 static void help_cmd_table(const cmd_entry_t *cmd)
 {
@@ -34,6 +35,15 @@ void do_netinfo(char *argv[], int argc)
 {
     int prefixlen = 0;
     uint32_t mask = interface_subnet_mask;
+    const eth_counters_t *eth;
+
+    if(argc == 1){
+        if(strcasecmp(argv[0], "reset") == 0)
+            net_counters_reset();
+        else
+            printf("netinfo: unknown option \"%s\"\n", argv[0]);
+        return;
+    }
     while(mask){
         prefixlen++;
         mask <<= 1;
@@ -58,13 +68,91 @@ void do_netinfo(char *argv[], int argc)
 
     printf("packet_rx_count %ld\n", packet_rx_count);
     printf("packet_tx_count %ld\n", packet_tx_count);
+    printf("packet_sink_lookup_count %ld", packet_sink_lookup_count);
+    if(packet_rx_count)
+        printf(" (%ld.%02ld per packet)", packet_sink_lookup_count / packet_rx_count,
+                (packet_sink_lookup_count % packet_rx_count) * 100 / packet_rx_count);
+    putchar('\n');
     printf("packet_alive_count %ld\n", packet_alive_count);
+    printf("packet_pool_size %ld\n", packet_pool_size);
+    printf("packet_pool_high_water %ld\n", packet_pool_high_water);
+    printf("packet_pool_exhausted_count %ld\n", packet_pool_exhausted_count);
     printf("packet_discard_count %ld\n", packet_discard_count);
     printf("packet_bad_cksum_count %ld\n", packet_bad_cksum_count);
+    printf("ipv4_reassembly_failures %ld\n", ipv4_reassembly_failures);
+    printf("eth_rxbuffer_size %d\n", eth_rxbuffer_size());
+    printf("eth_tx_slots %d\n", eth_tx_slots());
+
+    eth = eth_counters();
+    printf("eth_rx_overflows %ld\n", eth->rx_overflows);
+    printf("eth_rx_frame_errors %ld\n", eth->rx_frame_errors);
+    printf("eth_rx_crc_errors %ld\n", eth->rx_crc_errors);
+    printf("eth_rx_missed %ld\n", eth->rx_missed);
+    printf("eth_tx_collisions %ld\n", eth->tx_collisions);
+    printf("eth_tx_aborted %ld\n", eth->tx_aborted);
+    printf("eth_tx_full %ld\n", eth->tx_full);
 
     net_dump_packet_sinks();
 }
 
+void do_ethbuf(char *argv[], int argc)
+{
+    if(argc == 1)
+        eth_set_tx_slots(strtol(argv[0], NULL, 0));
+
+    printf("ethernet buffers: %d Tx slots, %d KB Rx ring\n",
+            eth_tx_slots(), eth_rxbuffer_size() >> 10);
+}
+
+void do_netconsole(char *argv[], int argc)
+{
+    uint32_t ip;
+    uint16_t port = 0;
+    const char *colon;
+
+    if(argc >= 1){
+        if(strcasecmp(argv[0], "off") == 0){
+            netconsole_stop();
+        }else{
+            ip = net_parse_ipv4(argv[0]);
+            if(!ip){
+                printf("netconsole: cannot parse IPv4 address \"%s\"\n", argv[0]);
+                return;
+            }
+            colon = strchr(argv[0], ':');
+            if(colon)
+                port = strtoul(colon+1, NULL, 10);
+            if(argc == 2 && strcasecmp(argv[1], "only") != 0){
+                printf("netconsole: unknown option \"%s\"\n", argv[1]);
+                return;
+            }
+            netconsole_start(ip, port, argc < 2);
+        }
+    }
+
+    netconsole_report();
+}
+
+void do_jobs(char *argv[], int argc)
+{
+    task_list();
+}
+
+void do_wait(char *argv[], int argc)
+{
+    task_t *task = NULL;
+
+    if(argc == 1){
+        task = task_find(strtoul(argv[0], NULL, 10));
+        if(!task){
+            printf("wait: no job %s\n", argv[0]);
+            return;
+        }
+    }
+
+    task_wait(task);
+}
+
 void do_date(char *argv[], int argc)
 {
 	report_current_time();
@@ -5,61 +5,236 @@
 #include <stdbool.h>
 #include <cli.h>
 #include <net.h>
+#include <loader.h>
+#include <init.h>
 
-void do_tftp_cli(char *argv[], int argc, bool is_put)
+static uint32_t tftp_server_address(const char *server)
 {
-    const char *server=NULL, *src, *dst;
-    uint32_t targetip = 0;
+    uint32_t targetip;
+
+    if(!server)
+        server = get_environment_variable("tftp_server");
+
+    if(!server){
+        printf("please specify the server IP address (or 'set tftp_server <ip>')\n");
+        return 0;
+    }
+
+    targetip = net_parse_ipv4(server);
+    if(targetip == 0)
+        printf("Cannot parse server IPv4 address \"%s\"\n", server);
+
+    return targetip;
+}
+
+// split "1.2.3.4:filename" into server and filename
+static char *split_server_filename(char *name, const char **server)
+{
+    char *colon = strchr(name, ':');
+
+    if(colon){
+        *colon = 0;
+        if(net_parse_ipv4(name)){
+            *server = name;
+            return colon + 1;
+        }
+        *colon = ':'; // not an IPv4 address; leave it alone
+    }
+
+    return name;
+}
+
+void do_tftp_cli(char *argv[], int argc, bool is_put, bool multicast)
+{
+    const char *server=NULL;
+    char *src, *dst, *args[3];
+    uint32_t targetip = 0, address, length = 0;
+    int count = 0, flags;
 
     // this needs some improvements to make it more user friendly
     // right now it expects the user to know too much
-    
-    switch(argc){
+
+    // memory is named "@address"; when sending it is followed by the length
+    for(int i=0; i<argc; i++){
+        if(count == 3){
+            printf("Unexpected number of arguments\n");
+            return;
+        }
+        args[count++] = argv[i];
+        if(is_put && argv[i][0] == '@'){
+            if(++i == argc){
+                printf("tftpput: @address must be followed by a length\n");
+                return;
+            }
+            length = parse_uint32(argv[i], NULL);
+        }
+    }
+
+    switch(count){
         case 1:
-            src = dst = argv[0];
+            src = dst = args[0];
             break;
         case 2:
-            src = argv[0];
-            dst = argv[1];
+            src = args[0];
+            dst = args[1];
             break;
         case 3:
-            server = argv[0];
-            src = argv[1];
-            dst = argv[2];
+            server = args[0];
+            src = args[1];
+            dst = args[2];
             break;
         default:
             printf("Unexpected number of arguments\n");
             return;
     }
 
-    if(!server)
-        server = get_environment_variable("tftp_server");
-
+    /* NOTE: src and dst argument order differs between put and get */
     if(!server){
-        printf("please specify the server IP address (or 'set tftp_server <ip>')\n");
+        if(is_put)
+            dst = split_server_filename(dst, &server);
+        else if(src == dst)
+            src = dst = split_server_filename(src, &server);
+        else
+            src = split_server_filename(src, &server);
+    }
+
+    targetip = tftp_server_address(server);
+    if(targetip == 0)
         return;
+
+    flags = (is_put ? TFTP_PUT : 0) | (multicast ? TFTP_MULTICAST : 0) | (cli_background ? TFTP_BACKGROUND : 0);
+
+    if(is_put){
+        if(src[0] == '@'){
+            if(dst[0] == '@'){
+                printf("tftpput: please specify the remote filename\n");
+                return;
+            }
+            address = parse_uint32(src+1, NULL);
+            tftp_transfer_memory(targetip, dst, address, length, flags);
+        }else
+            tftp_transfer_file(targetip, dst, src, flags);
+    }else{
+        if(dst[0] == '@'){
+            if(src[0] == '@'){
+                printf("tftp: please specify the remote filename\n");
+                return;
+            }
+            // allow the file to fill all free memory above the target address
+            address = parse_uint32(dst+1, NULL);
+            tftp_transfer_memory(targetip, src, address, free_memory_above(address), flags);
+        }else
+            tftp_transfer_file(targetip, src, dst, flags);
     }
+}
 
-    targetip = net_parse_ipv4(server);
-    if(targetip == 0){
-        printf("Cannot parse server IPv4 address \"%s\"\n", server);
+
+// tftpmget [server] file[=local|=@address] ...
+void do_tftp_multi_get(char *argv[], int argc)
+{
+    const char *server = NULL;
+    tftp_request_t *requests;
+    uint32_t targetip;
+    char *local;
+    int count = 0;
+
+    if(argc >= 2 && net_parse_ipv4(argv[0])){
+        server = argv[0];
+        argv++;
+        argc--;
+    }
+
+    targetip = tftp_server_address(server);
+    if(targetip == 0)
         return;
+
+    requests = malloc(argc * sizeof(tftp_request_t));
+    memset(requests, 0, argc * sizeof(tftp_request_t));
+
+    for(int i=0; i<argc; i++){
+        requests[count].tftp_filename = argv[i];
+        requests[count].disk_filename = argv[i];
+        local = strchr(argv[i], '=');
+        if(local){
+            *(local++) = 0;
+            if(local[0] == '@'){
+                // each file may run up to the end of free memory; keep them apart yourself
+                requests[count].disk_filename = NULL;
+                requests[count].address = parse_uint32(local+1, NULL);
+                requests[count].length = free_memory_above(requests[count].address);
+            }else
+                requests[count].disk_filename = local;
+        }
+        count++;
     }
 
-    /* NOTE: src and dst argument order differs between put and get */
-    if(is_put)
-        tftp_transfer(targetip, dst, src, true);
-    else
-        tftp_transfer(targetip, src, dst, false);
+    tftp_get_many(targetip, requests, count);
+    free(requests);
 }
 
-
 void do_tftp_get(char *argv[], int argc)
 {
-    do_tftp_cli(argv, argc, false);
+    do_tftp_cli(argv, argc, false, false);
 }
 
 void do_tftp_put(char *argv[], int argc)
 {
-    do_tftp_cli(argv, argc, true);
+    do_tftp_cli(argv, argc, true, false);
+}
+
+void do_tftp_multicast_get(char *argv[], int argc)
+{
+    do_tftp_cli(argv, argc, false, true);
+}
+
+static bool tftpboot_receive(void *cb_private, const uint8_t *data, int length)
+{
+    return elf_stream_write((elf_stream_t*)cb_private, data, length);
+}
+
+static void *tftpboot_locate(void *cb_private, uint32_t ahead, int length)
+{
+    return elf_stream_locate((elf_stream_t*)cb_private, ahead, length);
+}
+
+void do_tftpboot(char *argv[], int argc)
+{
+    const char *server = NULL;
+    uint32_t targetip;
+    elf_stream_t *stream;
+
+    // optional server IP address, then the ELF filename and its arguments
+    if(argc >= 2 && net_parse_ipv4(argv[0])){
+        server = argv[0];
+        argv++;
+        argc--;
+    }
+
+    targetip = tftp_server_address(server);
+    if(targetip == 0)
+        return;
+
+    // load the executable straight into memory as it arrives
+    stream = elf_stream_alloc();
+    if(tftp_receive(targetip, argv[0], tftpboot_receive, tftpboot_locate, stream))
+        elf_stream_execute(stream, argv, argc);
+    elf_stream_free(stream);
+}
+
+void do_tftpd(char *argv[], int argc)
+{
+    if(argc == 1){
+        if(!strcasecmp(argv[0], "on"))
+            tftp_server_enable(true);
+        else if(!strcasecmp(argv[0], "off"))
+            tftp_server_enable(false);
+        else{
+            printf("tftpd: expected \"on\" or \"off\"\n");
+            return;
+        }
+    }
+
+    printf("tftp server %s, %d transfer%s in progress\n",
+            tftp_server_enabled() ? "on" : "off",
+            tftp_server_transfers(), tftp_server_transfers() == 1 ? "" : "s");
 }
@@ -84,6 +84,8 @@ void report_current_time(void)
 
 void gogoboot(void)
 {
+    bool eth_found;
+
     early_init();
     uart_init();
     puts(copyright_msg);
@@ -104,8 +106,9 @@ void gogoboot(void)
     target_hardware_init();
 
     printf("Initialise ethernet: ");
-    net_init();
-    if(eth_init()){
+    eth_found = eth_init();
+    net_init(); // sizes packet pool from the card's receive buffer
+    if(eth_found){
         dhcp_init();
     }
 
@@ -23,6 +23,8 @@
 #include <cpu.h>
 #include <cli.h>
 #include <init.h>
+#include <loader.h>
+#include <task.h>
 
 /* bounce buffer */
 void   * loader_scratch_space = NULL;
@@ -51,11 +53,27 @@ uint32_t loader_bounce_buffer_target = 0;
     #pragma error update loader.c for your target
 #endif
 
+/* background jobs may still be filling memory the executable needs (eg an
+ * initrd), so collect them all first; any failure stops the boot */
+static bool wait_for_jobs(void)
+{
+    if(task_running())
+        printf("Waiting for background jobs to finish\n");
+    if(task_wait(NULL))
+        return true;
+    printf("Not starting: a background job failed or was cancelled\n");
+    return false;
+}
+
+/* returns only if the executable could not be started */
 void execute(void *entry_vector, int argc, char **argv)
 {
     int cmdlen = 1, cmdoff = 0, len;
     char *cmdbuf = 0;
 
+    if(!wait_for_jobs())
+        return;
+
     if(argc > 0){
         for(int i=0; i<argc; i++)
             cmdlen += strlen(argv[i]) + 1;
@@ -72,6 +90,7 @@ void execute(void *entry_vector, int argc, char **argv)
     }
 
     printf("Entry at 0x%lx in supervisor mode, SP 0x%lx\n", (uint32_t)entry_vector, ram_size);
+    netconsole_stop();
     uart_flush();
     eth_halt();
     cpu_interrupts_off();
@@ -120,6 +139,31 @@ static void bounce_expand(uint32_t paddr, uint32_t bounce_size)
     }
 }
 
+#define LOAD_CHUNK_SIZE (64*1024)
+
+/* f_read() in chunks, pumping the network in between so background jobs
+ * (eg a TFTP transfer of the initrd) keep going while we read the disk */
+static FRESULT load_read(FIL *fd, char *buffer, uint32_t size, unsigned int *bytes_read)
+{
+    FRESULT fr = FR_OK;
+    unsigned int chunk_read;
+    uint32_t chunk;
+
+    *bytes_read = 0;
+    while(size){
+        chunk = size < LOAD_CHUNK_SIZE ? size : LOAD_CHUNK_SIZE;
+        fr = f_read(fd, buffer, chunk, &chunk_read);
+        *bytes_read += chunk_read;
+        if(fr != FR_OK || chunk_read != chunk)
+            break;
+        buffer += chunk;
+        size -= chunk;
+        net_pump();
+    }
+
+    return fr;
+}
+
 FRESULT load_data(FIL *fd, uint32_t paddr, uint32_t offset, uint32_t file_size, uint32_t size)
 {
     unsigned int bytes_read;
@@ -183,7 +227,7 @@ FRESULT load_data(FIL *fd, uint32_t paddr, uint32_t offset, uint32_t file_size,
             if(fr != FR_OK)
                 return fr;
 
-            fr = f_read(fd, (char*)loader_bounce_buffer_data + bounce_addr, load_size, &bytes_read);
+            fr = load_read(fd, (char*)loader_bounce_buffer_data + bounce_addr, load_size, &bytes_read);
             if(fr != FR_OK)
                 return fr;
 
@@ -221,7 +265,7 @@ FRESULT load_data(FIL *fd, uint32_t paddr, uint32_t offset, uint32_t file_size,
             if(fr != FR_OK)
                 return fr;
 
-            fr = f_read(fd, (char*)paddr+bounce_size, load_size, &bytes_read);
+            fr = load_read(fd, (char*)paddr+bounce_size, load_size, &bytes_read);
             if(fr != FR_OK)
                 return fr;
             if(bytes_read != load_size){
@@ -264,72 +308,56 @@ bool load_m68k_executable(char *argv[], int argc, FIL *fd)
     }
 
     execute((void*)load_address, argc, argv);
-    return true; /* unlikely we will return ... */
+    return false; /* execute() returned, so it did not start */
 }
 
-bool load_elf_executable(char *argv[], int argc, FIL *fd)
+static bool elf_check_header(elf32_header *header)
 {
-    int proghead_num;
-    unsigned int bytes_read;
-    elf32_header header;
-    const char *load_err;
-    void *proghead_data = NULL;
-    elf32_program_header *proghead = NULL;
-#ifdef MACH_THIS
-    struct bootversion *bootver;
-    struct bi_record *bootinfo;
-    struct mem_info *meminfo;
-#endif
-    bool failed = false;
-    uint32_t max_load_addr = 0;
-    uint32_t min_load_addr = ~0;
-    uint32_t load_offset = 0;
-
-    f_lseek(fd, 0);
-    if(f_read(fd, &header, sizeof(header), &bytes_read) != FR_OK || bytes_read != sizeof(header)){
-        printf("Cannot read ELF file header\n");
-        return false;
-    }
-
-    if(header.ident_magic[0] != 0x7F ||
-       header.ident_magic[1] != 'E' ||
-       header.ident_magic[2] != 'L' ||
-       header.ident_magic[3] != 'F' ||
-       header.ident_version != 1){
+    if(header->ident_magic[0] != 0x7F ||
+       header->ident_magic[1] != 'E' ||
+       header->ident_magic[2] != 'L' ||
+       header->ident_magic[3] != 'F' ||
+       header->ident_version != 1){
         printf("Bad ELF header\n");
         return false;
     }
 
-    if(header.ident_class != 1 || /* 32-bit */
-       header.ident_data != 2 ||  /* big-endian */
-       header.ident_osabi != 0 ||
-       header.ident_abiversion != 0){
+    if(header->ident_class != 1 || /* 32-bit */
+       header->ident_data != 2 ||  /* big-endian */
+       header->ident_osabi != 0 ||
+       header->ident_abiversion != 0){
         printf("Not a 32-bit ELF file.\n");
         return false;
     }
 
-    if(header.type != 2){
+    if(header->type != 2){
         printf("ELF file is not an executable.\n");
         return false;
     }
 
-    if(header.machine != 4){
+    if(header->machine != 4){
         printf("ELF file is not for 68000 processor.\n");
         return false;
     }
 
-    proghead_data = malloc(header.phentsize * header.phnum);
-    if(f_lseek(fd, header.phoff) != FR_OK ||
-       f_read(fd, proghead_data, header.phentsize * header.phnum, NULL) != FR_OK){
-        printf("Cannot read ELF program headers.\n");
-        free(proghead_data);
-        return false;
-    }
+    return true;
+}
 
-    // initial scan over headers: check for conditions we cannot load,
-    // figure out the min and max load addresses
-    for(proghead_num=0; !failed && proghead_num < header.phnum; proghead_num++){
-        proghead = (elf32_program_header*)(proghead_data + proghead_num * header.phentsize);
+// scan over program headers: check for conditions we cannot load,
+// figure out the min and max load addresses and any offset required
+static bool elf_scan_program_headers(elf32_header *header, void *proghead_data,
+        uint32_t *min_addr, uint32_t *max_addr, uint32_t *offset)
+{
+    int proghead_num;
+    const char *load_err;
+    elf32_program_header *proghead = NULL;
+    bool failed = false;
+    uint32_t max_load_addr = 0;
+    uint32_t min_load_addr = ~0;
+    uint32_t load_offset = 0;
+
+    for(proghead_num=0; !failed && proghead_num < header->phnum; proghead_num++){
+        proghead = (elf32_program_header*)(proghead_data + proghead_num * header->phentsize);
         switch(proghead->type){
             case PT_NULL:
             case PT_NOTE:
@@ -354,10 +382,8 @@ bool load_elf_executable(char *argv[], int argc, FIL *fd)
         }
     }
 
-    if(failed){
-        free(proghead_data);
+    if(failed)
         return false;
-    }
 
     printf("Load address range 0x%lx -- 0x%lx\n", min_load_addr, max_load_addr);
 
@@ -376,35 +402,29 @@ bool load_elf_executable(char *argv[], int argc, FIL *fd)
     load_err = check_writable_range(min_load_addr, max_load_addr - min_load_addr, true);
     if(load_err){
         printf("Abort: address range error: %s\n", load_err);
-        failed = true;
-    }
-
-    if(failed){
-        free(proghead_data);
         return false;
     }
 
-    // second pass: do the actual loading
-    for(proghead_num=0; !failed && proghead_num < header.phnum; proghead_num++){
-        proghead = (elf32_program_header*)(proghead_data + proghead_num * header.phentsize);
-        switch(proghead->type){
-            case PT_LOAD:
-                if(load_data(fd, load_offset + proghead->paddr, proghead->offset, proghead->filesz, proghead->memsz) != FR_OK){
-                    printf("Unable to load segment from ELF file.\n");
-                    failed = true;
-                }                
-                break;
-            default:
-                break;
-        }
-    }
+    *min_addr = min_load_addr;
+    *max_addr = max_load_addr;
+    *offset = load_offset;
+    return true;
+}
 
-    free(proghead_data);
-    proghead_data = NULL;
-    if(failed)
+// called once all segments are in memory; prepares linux bootinfo if
+// required, then jumps to the entry vector
+static bool elf_execute(uint32_t entry, uint32_t min_load_addr, uint32_t max_load_addr, char *argv[], int argc)
+{
+#ifdef MACH_THIS
+    unsigned int bytes_read;
+    struct bootversion *bootver;
+    struct bi_record *bootinfo;
+    struct mem_info *meminfo;
+
+    /* before we read an initrd that a job may be fetching, or turn interrupts off */
+    if(!wait_for_jobs())
         return false;
 
-#ifdef MACH_THIS
     /* check for linux kernel magic number at lowest load address */
     if(min_load_addr < bounce_below_addr)
         bootver = (struct bootversion*)loader_bounce_buffer_data;
@@ -520,9 +540,33 @@ bool load_elf_executable(char *argv[], int argc, FIL *fd)
         /* knobble argc so that we do not recombine it inside execute() */
         argc = 0;
 
-        /* check for initrd */
+        /* check for initrd: "@ADDRESS:LENGTH" is already in memory (eg from a background tftp) */
         FIL initrd;
-        if(initrd_name && (f_open(&initrd, initrd_name, FA_READ) == FR_OK)){
+        if(initrd_name && initrd_name[0] == '@'){
+            const char *p;
+            uint32_t initrd_addr = parse_uint32(initrd_name+1, &p);
+            uint32_t initrd_size = (*p == ':') ? parse_uint32(p+1, &p) : 0;
+            const char *range_err = check_writable_range(initrd_addr, initrd_size, false);
+
+            if(*p || !initrd_size){
+                printf("initrd=@ADDRESS:LENGTH expected.\n");
+                return false;
+            }
+            /* leave room for the rest of the bootinfo */
+            if(!range_err && initrd_addr < (uint32_t)bootinfo + 0x1000)
+                range_err = "overlaps kernel";
+            if(range_err){
+                printf("initrd at 0x%lx: %s\n", initrd_addr, range_err);
+                return false;
+            }
+            bootinfo->tag = BI_RAMDISK;
+            bootinfo->size = sizeof(struct bi_record) + sizeof(struct mem_info);
+            meminfo = (struct mem_info*)bootinfo->data;
+            meminfo->addr = initrd_addr;
+            meminfo->size = initrd_size;
+            printf("Using initrd in memory: %ld bytes at 0x%lx\n", meminfo->size, meminfo->addr);
+            bootinfo = (struct bi_record*)(((char*)bootinfo) + bootinfo->size);
+        }else if(initrd_name && (f_open(&initrd, initrd_name, FA_READ) == FR_OK)){
             bootinfo->tag = BI_RAMDISK;
             bootinfo->size = sizeof(struct bi_record) + sizeof(struct mem_info);
             meminfo = (struct mem_info*)bootinfo->data;
@@ -530,7 +574,7 @@ bool load_elf_executable(char *argv[], int argc, FIL *fd)
             meminfo->addr = ((((unsigned long)bootinfo) + 0xfff) & ~0xfff) + 0x100000;
             meminfo->size = f_size(&initrd);
             printf("Loading initrd \"%s\": %ld bytes at 0x%lx\n", initrd_name, meminfo->size, meminfo->addr);
-            if(f_read(&initrd, (char*)meminfo->addr, meminfo->size, &bytes_read) != FR_OK || 
+            if(load_read(&initrd, (char*)meminfo->addr, meminfo->size, &bytes_read) != FR_OK || 
                     bytes_read != meminfo->size){
                 printf("Unable to load initrd.\n");
                 return false;
@@ -558,14 +602,311 @@ bool load_elf_executable(char *argv[], int argc, FIL *fd)
         /* could bail here if load offset was applied */
     }
 #endif
-    if(!failed){
-        /* remove program name from command line */
-        if(argc > 0){
-            argc--;
-            argv++;
+    /* remove program name from command line */
+    if(argc > 0){
+        argc--;
+        argv++;
+    }
+    execute((void*)entry, argc, argv);
+
+    return false; /* execute() returned, so it did not start */
+}
+
+bool load_elf_executable(char *argv[], int argc, FIL *fd)
+{
+    int proghead_num;
+    unsigned int bytes_read;
+    elf32_header header;
+    void *proghead_data = NULL;
+    elf32_program_header *proghead = NULL;
+    bool failed = false;
+    uint32_t max_load_addr, min_load_addr, load_offset;
+
+    f_lseek(fd, 0);
+    if(f_read(fd, &header, sizeof(header), &bytes_read) != FR_OK || bytes_read != sizeof(header)){
+        printf("Cannot read ELF file header\n");
+        return false;
+    }
+
+    if(!elf_check_header(&header))
+        return false;
+
+    proghead_data = malloc(header.phentsize * header.phnum);
+    if(f_lseek(fd, header.phoff) != FR_OK ||
+       f_read(fd, proghead_data, header.phentsize * header.phnum, NULL) != FR_OK){
+        printf("Cannot read ELF program headers.\n");
+        free(proghead_data);
+        return false;
+    }
+
+    if(!elf_scan_program_headers(&header, proghead_data, &min_load_addr, &max_load_addr, &load_offset)){
+        free(proghead_data);
+        return false;
+    }
+
+    // second pass: do the actual loading
+    for(proghead_num=0; !failed && proghead_num < header.phnum; proghead_num++){
+        proghead = (elf32_program_header*)(proghead_data + proghead_num * header.phentsize);
+        switch(proghead->type){
+            case PT_LOAD:
+                if(load_data(fd, load_offset + proghead->paddr, proghead->offset, proghead->filesz, proghead->memsz) != FR_OK){
+                    printf("Unable to load segment from ELF file.\n");
+                    failed = true;
+                }                
+                break;
+            default:
+                break;
+        }
+    }
+
+    free(proghead_data);
+    proghead_data = NULL;
+    if(failed)
+        return false;
+
+    return elf_execute(header.entry + load_offset, min_load_addr, max_load_addr, argv, argc);
+}
+
+/*
+ * The streaming ELF loader consumes an executable sequentially, as it arrives
+ * (eg over the network), rather than seeking around in a file. The ELF header
+ * and program headers are buffered until complete. Then we check the load
+ * addresses, set up any bounce buffer and zero the BSS of every PT_LOAD
+ * segment before placing any data. Thereafter each chunk of the file is
+ * copied directly to its final location in memory (or the bounce buffer).
+ */
+
+#define ELF_STREAM_MAX_HEADERS 4096 /* ELF header + program headers must fit in this */
+
+struct elf_stream_t {
+    elf32_header header;
+    uint8_t *head_data;       /* start of file, buffered until headers are parsed */
+    uint32_t head_length;     /* bytes required in head_data */
+    uint32_t offset;          /* file offset of the next byte to arrive */
+    uint32_t required_length; /* file offset of the end of the last PT_LOAD segment */
+    uint32_t min_load_addr;
+    uint32_t max_load_addr;
+    uint32_t load_offset;
+    bool header_valid;        /* ELF header checked */
+    bool ready;               /* program headers checked and memory prepared */
+    bool failed;
+};
+
+/* copy data into target memory at paddr, diverting anything below
+ * bounce_below_addr into the bounce buffer. data=NULL writes zeroes. */
+static void loader_place(uint32_t paddr, const void *data, uint32_t length)
+{
+    uint32_t chunk;
+    void *dest;
+
+    while(length){
+        if(paddr < bounce_below_addr){
+            chunk = bounce_below_addr - paddr;
+            if(chunk > length)
+                chunk = length;
+            dest = loader_bounce_buffer_data + (paddr - loader_bounce_buffer_target);
+        }else{
+            chunk = length;
+            dest = (void*)paddr;
+        }
+        if(data){
+            if(dest != data) // already in place? (see elf_stream_locate)
+                memcpy(dest, data, chunk);
+            data += chunk;
+        }else
+            memset(dest, 0, chunk);
+        paddr += chunk;
+        length -= chunk;
+    }
+}
+
+static bool elf_stream_prepare(elf_stream_t *s)
+{
+    int proghead_num;
+    const char *load_err;
+    elf32_program_header *proghead;
+    void *proghead_data = s->head_data + s->header.phoff;
+    uint32_t paddr, bounce_size;
+
+    if(!elf_scan_program_headers(&s->header, proghead_data,
+                &s->min_load_addr, &s->max_load_addr, &s->load_offset))
+        return false;
+
+    // first pass: check each segment, size the bounce buffer. this must be
+    // complete before we write anything, since bounce_expand() may move data.
+    for(proghead_num=0; proghead_num < s->header.phnum; proghead_num++){
+        proghead = (elf32_program_header*)(proghead_data + proghead_num * s->header.phentsize);
+        if(proghead->type != PT_LOAD || proghead->memsz == 0)
+            continue;
+        if(proghead->filesz > proghead->memsz){
+            printf("Bad ELF segment (filesz > memsz)\n");
+            return false;
+        }
+        paddr = s->load_offset + proghead->paddr;
+        load_err = check_writable_range(paddr, proghead->memsz, true);
+        if(load_err){
+            printf("Abort: address range error: %s\n", load_err);
+            return false;
         }
-        execute((void*)(header.entry + load_offset), argc, argv);
+        if(paddr < bounce_below_addr){
+            bounce_size = bounce_below_addr - paddr;
+            if(bounce_size > proghead->memsz)
+                bounce_size = proghead->memsz;
+            bounce_expand(paddr, bounce_size);
+        }
+        if(proghead->offset + proghead->filesz > s->required_length)
+            s->required_length = proghead->offset + proghead->filesz;
+    }
+
+    // second pass: zero the BSS portion of each segment
+    for(proghead_num=0; proghead_num < s->header.phnum; proghead_num++){
+        proghead = (elf32_program_header*)(proghead_data + proghead_num * s->header.phentsize);
+        if(proghead->type != PT_LOAD || proghead->memsz == 0)
+            continue;
+        paddr = s->load_offset + proghead->paddr;
+        printf("Streaming 0x%lx bytes", proghead->filesz);
+        if(proghead->memsz > proghead->filesz)
+            printf(" + 0x%lx padding", proghead->memsz - proghead->filesz);
+        printf(" from file offset 0x%lx to memory at 0x%lx\n", proghead->offset, paddr);
+        loader_place(paddr + proghead->filesz, NULL, proghead->memsz - proghead->filesz);
     }
 
     return true;
 }
+
+/* place file data starting at file offset 'offset' into each PT_LOAD segment it overlaps */
+static void elf_stream_place(elf_stream_t *s, uint32_t offset, const void *data, uint32_t length)
+{
+    int proghead_num;
+    elf32_program_header *proghead;
+    void *proghead_data = s->head_data + s->header.phoff;
+    uint32_t start, end;
+
+    for(proghead_num=0; proghead_num < s->header.phnum; proghead_num++){
+        proghead = (elf32_program_header*)(proghead_data + proghead_num * s->header.phentsize);
+        if(proghead->type != PT_LOAD)
+            continue;
+        start = proghead->offset;
+        end = proghead->offset + proghead->filesz;
+        if(start < offset)
+            start = offset;
+        if(end > offset + length)
+            end = offset + length;
+        if(start < end)
+            loader_place(s->load_offset + proghead->paddr + (start - proghead->offset),
+                    data + (start - offset), end - start);
+    }
+}
+
+/* where will the file data starting 'ahead' bytes beyond the next byte to
+ * arrive end up? returns NULL unless all 'length' bytes lie within a single
+ * PT_LOAD segment and go directly to memory rather than the bounce buffer.
+ * the caller may deposit the data there early, then pass that same pointer
+ * to elf_stream_write when its turn comes. */
+void *elf_stream_locate(elf_stream_t *s, uint32_t ahead, uint32_t length)
+{
+    int proghead_num;
+    elf32_program_header *proghead;
+    void *proghead_data = s->head_data + s->header.phoff;
+    uint32_t start = s->offset + ahead, paddr;
+
+    if(!s->ready || s->failed)
+        return NULL;
+
+    for(proghead_num=0; proghead_num < s->header.phnum; proghead_num++){
+        proghead = (elf32_program_header*)(proghead_data + proghead_num * s->header.phentsize);
+        if(proghead->type != PT_LOAD)
+            continue;
+        if(start >= proghead->offset && start + length <= proghead->offset + proghead->filesz){
+            paddr = s->load_offset + proghead->paddr + (start - proghead->offset);
+            if(paddr < bounce_below_addr)
+                return NULL;
+            return (void*)paddr;
+        }
+    }
+
+    return NULL;
+}
+
+elf_stream_t *elf_stream_alloc(void)
+{
+    elf_stream_t *s = malloc(sizeof(elf_stream_t));
+    memset(s, 0, sizeof(elf_stream_t));
+    s->head_data = malloc(ELF_STREAM_MAX_HEADERS);
+    s->head_length = sizeof(elf32_header);
+    return s;
+}
+
+void elf_stream_free(elf_stream_t *s)
+{
+    free(s->head_data);
+    free(s);
+}
+
+bool elf_stream_write(elf_stream_t *s, const void *data, uint32_t length)
+{
+    uint32_t chunk;
+
+    if(s->failed)
+        return false;
+
+    // accumulate the ELF header and program headers
+    while(!s->ready){
+        chunk = s->head_length - s->offset;
+        if(chunk > length)
+            chunk = length;
+        memcpy(s->head_data + s->offset, data, chunk);
+        s->offset += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if(s->offset < s->head_length)
+            return true; // wait for more data
+
+        if(!s->header_valid){
+            memcpy(&s->header, s->head_data, sizeof(elf32_header));
+            if(!elf_check_header(&s->header)){
+                s->failed = true;
+                return false;
+            }
+            s->header_valid = true;
+            s->head_length = s->header.phoff + s->header.phentsize * s->header.phnum;
+            if(s->head_length > ELF_STREAM_MAX_HEADERS){
+                printf("ELF program headers too far into file.\n");
+                s->failed = true;
+                return false;
+            }
+            if(s->head_length < s->offset)
+                s->head_length = s->offset;
+        }else{
+            if(!elf_stream_prepare(s)){
+                s->failed = true;
+                return false;
+            }
+            s->ready = true;
+            // the first segment often includes the headers; place the data we buffered
+            elf_stream_place(s, 0, s->head_data, s->offset);
+        }
+    }
+
+    if(length){
+        elf_stream_place(s, s->offset, data, length);
+        s->offset += length;
+    }
+
+    return true;
+}
+
+bool elf_stream_execute(elf_stream_t *s, char *argv[], int argc)
+{
+    if(s->failed)
+        return false;
+
+    if(!s->ready || s->offset < s->required_length){
+        printf("ELF file truncated (0x%lx of 0x%lx bytes)\n", s->offset,
+                s->ready ? s->required_length : s->head_length);
+        return false;
+    }
+
+    return elf_execute(s->header.entry + s->load_offset, s->min_load_addr, s->max_load_addr, argv, argc);
+}
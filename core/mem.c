@@ -81,3 +81,12 @@ const char *check_writable_range(uint32_t base, uint32_t length, bool can_bounce
     return NULL;
 }
 
+/* bytes from base to the start of the heap (or the end of RAM): how much a
+   download to base may fill without check_writable_range() complaining */
+uint32_t free_memory_above(uint32_t base)
+{
+    uint32_t top = (heap_base < ram_size ? heap_base : ram_size);
+
+    return (base < top) ? top - base : 0;
+}
+
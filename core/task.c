@@ -0,0 +1,135 @@
+/* (c) 2023 William R Sowerbutts <will@sowerbutts.com> */
+
+#include <types.h>
+#include <stdlib.h>
+#include <uart.h>
+#include <net.h>
+#include <task.h>
+
+/* A small cooperative run-queue. Each task has a poll function which does
+ * a little work and returns true once the task has finished; net_pump()
+ * polls every task, so anything that keeps the network going (the CLI
+ * waiting for a line, a script between lines, a foreground transfer, the
+ * loader between disk reads) keeps the background jobs going too. Finished
+ * tasks hold on to their result until task_wait() or task_list() collects
+ * them. */
+
+static task_t *task_head = NULL;
+static int task_next_id = 1;
+static bool task_pumping = false;
+
+task_t *task_create(const char *name, task_poll_cb_t cb_poll, void *task_private)
+{
+    task_t *task, **tail;
+
+    task = malloc(sizeof(task_t));
+    memset(task, 0, sizeof(task_t));
+    task->name = strdup(name);
+    task->cb_poll = cb_poll;
+    task->task_private = task_private;
+
+    if(!task_head)
+        task_next_id = 1; // number jobs from 1 again once the list is empty
+    task->id = task_next_id++;
+
+    for(tail = &task_head; *tail; tail = &(*tail)->next);
+    *tail = task;
+
+    return task;
+}
+
+static void task_free(task_t *task)
+{
+    task_t **p;
+
+    for(p = &task_head; *p; p = &(*p)->next){
+        if(*p == task){
+            *p = task->next;
+            break;
+        }
+    }
+
+    free(task->name);
+    free(task);
+}
+
+task_t *task_find(int id)
+{
+    task_t *task;
+
+    for(task = task_head; task; task = task->next)
+        if(task->id == id)
+            return task;
+
+    return NULL;
+}
+
+void task_pump(void)
+{
+    task_t *task;
+
+    if(task_pumping) // a task's poll function pumped the network
+        return;
+
+    task_pumping = true;
+    for(task = task_head; task; task = task->next){
+        if(!task->finished && task->cb_poll(task)){
+            task->finished = true;
+            printf("[%d] %s: %s\n", task->id, task->success ? "Done" : "FAILED", task->name);
+        }
+    }
+    task_pumping = false;
+}
+
+int task_running(void)
+{
+    task_t *task;
+    int count = 0;
+
+    for(task = task_head; task; task = task->next)
+        if(!task->finished)
+            count++;
+
+    return count;
+}
+
+bool task_wait(task_t *task)
+{
+    task_t *next;
+    bool success = true;
+
+    while(task ? !task->finished : task_running() > 0){
+        net_pump();
+        if(uart_check_cancel_key()){
+            printf("(stopped waiting)\n");
+            return false;
+        }
+    }
+
+    if(task){
+        success = task->success;
+        task_free(task);
+    }else{
+        for(task = task_head; task; task = next){
+            next = task->next;
+            success = success && task->success;
+            task_free(task);
+        }
+    }
+
+    return success;
+}
+
+void task_list(void)
+{
+    task_t *task, *next;
+
+    for(task = task_head; task; task = next){
+        next = task->next;
+        printf("[%d] %-7s %6d KB  %s\n", task->id,
+                !task->finished ? "Running" : task->success ? "Done" : "FAILED",
+                task->progress >> 10, task->name);
+        if(task->finished)
+            task_free(task);
+    }
+}
@@ -39,6 +39,18 @@ static const char* uart_chip_name[] = {
     [UART_16950B]  = "16950B",
 };
 
+/* a second console (net/netconsole.c) can see our output and supply input */
+static void (*console_write_hook)(char b) = NULL;
+static int (*console_read_hook)(void) = NULL;
+static bool console_uart_output = true;
+
+void uart_set_console_hooks(void (*write_hook)(char b), int (*read_hook)(void), bool uart_output)
+{
+    console_write_hook = write_hook;
+    console_read_hook = read_hook;
+    console_uart_output = uart_output;
+}
+
 static uart_type_t uart_type = UART_UNKNOWN;
 
 static void uart_icr_write(uint8_t offset, uint8_t value)
@@ -166,6 +178,10 @@ void uart_flush(void)
 
 void uart_write_byte(char b)
 {
+    if(console_write_hook)
+        console_write_hook(b);
+    if(!console_uart_output)
+        return;
     while(!(uart_inb(UART_ADDRESS+UART_LSR) & UART_LSR_THRE));
     uart_outb(UART_ADDRESS+UART_THR, b);
 }
@@ -191,6 +207,10 @@ bool uart_read_ready(void)
 
 int uart_read_byte(void)
 {
+    int b;
+
+    if(console_read_hook && (b = console_read_hook()) >= 0)
+        return b;
     if(uart_inb(UART_ADDRESS+UART_LSR) & UART_LSR_DR)
         return uart_inb(UART_ADDRESS+UART_RBR);
     else
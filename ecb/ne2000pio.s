@@ -0,0 +1,98 @@
+/* NE2000 remote DMA data port block transfers for ECB targets (8-bit)
+ *
+ * Bytes are moved in pairs so that the receive checksum can be accumulated
+ * a 16-bit word at a time, first byte in the high half. The loops move 8
+ * pairs per pass, after first dealing with any pairs that do not make up
+ * a whole pass. Only 68000 addressing modes are used, and buf need not be
+ * aligned.
+ *
+ * uint32_t ne2000_pio_in(void *buf, volatile void *port, int pairs, uint32_t sum)
+ *     reads pairs of bytes into buf, returns sum plus the (unfolded)
+ *     one's complement sum of the words read
+ * void ne2000_pio_out(const void *buf, volatile void *port, int pairs)
+ */
+
+        .globl  ne2000_pio_in
+        .globl  ne2000_pio_out
+
+        .text
+        .even
+
+.macro  PIO_IN_PAIR
+    moveb %a1@,%d0              /* first byte */
+    moveb %d0,%a0@+
+    lslw #8,%d0                 /* ... into the high half */
+    moveb %a1@,%d0              /* second byte */
+    moveb %d0,%a0@+
+    addl %d0,%d1                /* accumulate checksum */
+.endm
+
+.macro  PIO_OUT_PAIR
+    moveb %a0@+,%a1@
+    moveb %a0@+,%a1@
+.endm
+
+ne2000_pio_in:
+    moveal %sp@(4),%a0          /* void *buf */
+    moveal %sp@(8),%a1          /* data port */
+    movel %sp@(16),%d1          /* uint32_t sum */
+
+    /* save registers */
+    movem.l %d2-%d3,-(%sp)
+
+    movel %sp@(20),%d2          /* int pairs (8 bytes of saved registers) */
+    moveq #7,%d3
+    andl %d2,%d3                /* pairs in the partial pass */
+    lsrl #3,%d2                 /* number of whole passes */
+    moveq #0,%d0                /* top half stays clear for addl */
+    bra pio_in_part_next
+
+pio_in_part:
+    PIO_IN_PAIR
+pio_in_part_next:
+    dbra %d3,pio_in_part
+    bra pio_in_next
+
+pio_in_pass:
+    .rept 8
+    PIO_IN_PAIR
+    .endr
+pio_in_next:
+    dbra %d2,pio_in_pass
+
+    /* restore registers, return sum */
+    movel %d1,%d0
+    movem.l (%sp)+,%d2-%d3
+    rts
+
+
+ne2000_pio_out:
+    moveal %sp@(4),%a0          /* const void *buf */
+    moveal %sp@(8),%a1          /* data port */
+    movel %sp@(12),%d1          /* int pairs */
+
+    /* save registers */
+    movel %d2,-(%sp)
+
+    moveq #7,%d2
+    andl %d1,%d2                /* pairs in the partial pass */
+    lsrl #3,%d1                 /* number of whole passes */
+    bra pio_out_part_next
+
+pio_out_part:
+    PIO_OUT_PAIR
+pio_out_part_next:
+    dbra %d2,pio_out_part
+    bra pio_out_next
+
+pio_out_pass:
+    .rept 8
+    PIO_OUT_PAIR
+    .endr
+pio_out_next:
+    dbra %d1,pio_out_pass
+
+    /* restore registers, return */
+    movel (%sp)+,%d2
+    rts
+        .end
@@ -122,6 +122,55 @@ void rtc_read_clock(rtc_time_t *buffer)
     rtc_idle(); /* all done */
 }
 
+/* the DS1302 has 31 bytes of RAM, accessed a byte at a time */
+#define DS1302_RAM_SIZE     31
+#define DS1302_RAM_READ     0xC1 /* | (address << 1) */
+#define DS1302_RAM_WRITE    0xC0 /* | (address << 1) */
+#define DS1302_WP_WRITE     0x8E /* control register; bit 7 is write protect */
+
+static uint8_t rtc_read_register(uint8_t command)
+{
+    uint8_t value;
+
+    rtc_set_clk(false);
+    rtc_set_chipselect(true);
+    rtc_send_byte(command);
+    value = rtc_read_byte();
+    rtc_idle();
+
+    return value;
+}
+
+static void rtc_write_register(uint8_t command, uint8_t value)
+{
+    rtc_set_clk(false);
+    rtc_set_chipselect(true);
+    rtc_send_byte(command);
+    rtc_send_byte(value);
+    rtc_idle();
+}
+
+int rtc_nvram_size(void)
+{
+    return DS1302_RAM_SIZE;
+}
+
+uint8_t rtc_nvram_read(int offset)
+{
+    if(offset >= 0 && offset < DS1302_RAM_SIZE)
+        return rtc_read_register(DS1302_RAM_READ | (offset << 1));
+    return 0xff;
+}
+
+void rtc_nvram_write(int offset, uint8_t value)
+{
+    if(offset >= 0 && offset < DS1302_RAM_SIZE){
+        rtc_write_register(DS1302_WP_WRITE, 0x00);
+        rtc_write_register(DS1302_RAM_WRITE | (offset << 1), value);
+        rtc_write_register(DS1302_WP_WRITE, 0x80);
+    }
+}
+
 void rtc_init(void)
 {
     mfpic_rtc_shadow = 0;
@@ -11,6 +11,9 @@
 #include <disk.h>
 #include <rtc.h>
 
+uint32_t disk_write_calls = 0;
+uint32_t disk_write_sectors = 0;
+
 DSTATUS disk_status(BYTE pdrv)
 {
     disk_t *disk_disk = disk_get_info(pdrv);
@@ -61,6 +64,9 @@ DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
     if(disk_disk->fat_fs_status & STA_PROTECT)
         return RES_WRPRT;
 
+    disk_write_calls++;
+    disk_write_sectors += count;
+
     if(disk_data_write(pdrv, buff, sector, count))
         return RES_OK;
     else
@@ -27,8 +27,11 @@ typedef struct
     const int max_args;
     void (* function)(char *argv[], int argc);
     const char *helpme;
+    const bool background;  /* can run as a job, given a trailing "&" */
 } cmd_entry_t;
 
+extern bool cli_background; /* set while running a command given a trailing "&" */
+
 extern const cmd_entry_t target_cmd_table[];
 extern const cmd_entry_t builtin_cmd_table[];
 
@@ -56,11 +59,22 @@ void memory_test(uint32_t base, uint32_t size);
 void help(char *argv[], int argc);
 void do_meminfo(char *argv[], int argc);
 void do_netinfo(char *argv[], int argc);
+void do_ethbuf(char *argv[], int argc);
+void do_netconsole(char *argv[], int argc);
 void do_date(char *argv[], int argc);
+void do_jobs(char *argv[], int argc);
+void do_wait(char *argv[], int argc);
 
 // cli_tftp.c
 void do_tftp_get(char *argv[], int argc);
 void do_tftp_put(char *argv[], int argc);
+void do_tftp_multicast_get(char *argv[], int argc);
+void do_tftp_multi_get(char *argv[], int argc);
+void do_tftpboot(char *argv[], int argc);
+void do_tftpd(char *argv[], int argc);
+
+// cli_http.c
+void do_http(char *argv[], int argc);
 
 // cli_load.c
 void do_execute(char *argv[], int argc);
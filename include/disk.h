@@ -27,6 +27,8 @@ typedef struct disk_t {
 /* common ide code provides these methods */
 void disk_init(void);
 disk_t *disk_get_info(int nr);
+extern uint32_t disk_write_calls;   /* disk_write() calls from FatFs, fatfs/ffglue.c */
+extern uint32_t disk_write_sectors;
 int disk_get_count(void);
 bool disk_data_read(int disk, void *buff, uint32_t sector, int sector_count);
 bool disk_data_write(int disk, const void *buff, uint32_t sector, int sector_count);
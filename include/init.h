@@ -20,6 +20,7 @@ void setup_interrupts(void);
 void measure_ram_size(void);
 void report_memory_layout(void);
 const char *check_writable_range(uint32_t base, uint32_t length, bool can_bounce);
+uint32_t free_memory_above(uint32_t base);
 
 /* target provides these, used by measure_ram_size */
 /* these are called with a relatively small stack! */
@@ -4,4 +4,12 @@
 bool load_m68k_executable(char *argv[], int argc, FIL *fd);
 bool load_elf_executable(char *arg[], int numarg, FIL *fd);
 
+/* streaming ELF loader: data is placed in memory as it arrives, in file order */
+typedef struct elf_stream_t elf_stream_t;
+elf_stream_t *elf_stream_alloc(void);
+void elf_stream_free(elf_stream_t *s);
+bool elf_stream_write(elf_stream_t *s, const void *data, uint32_t length); // false on error
+void *elf_stream_locate(elf_stream_t *s, uint32_t ahead, uint32_t length); // destination of future data, or NULL
+bool elf_stream_execute(elf_stream_t *s, char *argv[], int argc);
+
 #endif
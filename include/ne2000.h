@@ -73,24 +73,41 @@ are GPL, so this is, of course, GPL.
 */
 
 #include <types.h>
+#include <net.h>
+
+/* Transmit ring: frames are queued in consecutive slots of card memory and
+   chained back to back from the Tx interrupt, so the wire stays busy while
+   we fill the next slot. Whatever the Tx slots do not use is the Rx ring. */
+#define NE2000_TX_SLOT_PAGES    6       /* 6x256=1.5KB, one full frame */
+#define NE2000_TX_SLOTS_MAX     8
+#ifndef NE2000_TX_SLOTS
+#define NE2000_TX_SLOTS         2       /* default, as the old ping-pong pair; ethbuf trades Rx pages for more */
+#endif
+#define NE2000_RX_MIN_PAGES     20      /* 20x256=5KB */
 
 typedef struct dp83902a_priv_data {
     uint16_t base;
     uint16_t data;
     bool rtl8019;
-    int tx_next;           /* First free Tx page */
-    int tx_int;            /* Expecting interrupt from this buffer */
     int rx_next;           /* First free Rx page */
-    int tx1, tx2;          /* Page numbers for Tx buffers */
-    /* unsigned long tx1_key, tx2_key;   // Used to ack when packet sent */
-    int tx1_len, tx2_len;
+    int tx_fill;           /* Next Tx slot to be filled */
+    int tx_xmit;           /* Tx slot being transmitted, when tx_started */
+    int tx_count;          /* Tx slots filled and not yet transmitted */
+    int tx_len[NE2000_TX_SLOTS_MAX];
     bool tx_started, running;
     uint8_t esa[6];
+    uint8_t mar[8];        /* Multicast hash filter, programmed by dp83902a_start */
+    bool multicast;        /* Accept frames matching mar[] */
     void* plf_priv;
 
     /* Buffer allocation */
-    int tx_buf1, tx_buf2;
+    int tx_slots;          /* Tx slots in use, each NE2000_TX_SLOT_PAGES long */
+    int tx_buf_start;      /* First page of Tx slot 0 */
     int rx_buf_start, rx_buf_end;
+    uint32_t rx_sum;           /* Checksum accumulated by dp83902a_recv_data */
+
+    /* Statistics */
+    eth_counters_t counters;
 } dp83902a_priv_data_t;
 
 /*
@@ -99,6 +116,11 @@ typedef struct dp83902a_priv_data {
 */
 static void dp83902a_poll(void);
 
+/* data port block transfers: q40/ne2000pio.s, ecb/ne2000pio.s
+   count is in 16-bit words (16-bit PIO) or pairs of bytes (8-bit PIO) */
+uint32_t ne2000_pio_in(void *buf, volatile void *port, int count, uint32_t sum);
+void ne2000_pio_out(const void *buf, volatile void *port, int count);
+
 /* ------------------------------------------------------------------------ */
 /* Register offsets */
 
@@ -13,10 +13,12 @@ typedef struct ipv4_header_t ipv4_header_t;
 typedef struct udp_header_t udp_header_t;
 typedef struct tcp_header_t tcp_header_t;
 typedef struct icmp_header_t icmp_header_t;
+typedef struct igmp_header_t igmp_header_t;
 typedef uint8_t macaddr_t[6];
 
 extern macaddr_t const broadcast_macaddr;
 static const uint32_t ipv4_broadcast = 0xffffffff;
+static inline bool ipv4_is_multicast(uint32_t ip) { return (ip & 0xf0000000) == 0xe0000000; } // 224.0.0.0/4
 
 extern macaddr_t interface_macaddr;
 extern uint32_t interface_ipv4_address;
@@ -25,10 +27,15 @@ extern uint32_t interface_ipv4_gateway;
 extern uint32_t interface_dns_server;
 
 extern uint32_t packet_alive_count;
+extern uint32_t packet_pool_size;
+extern uint32_t packet_pool_high_water;
+extern uint32_t packet_pool_exhausted_count;
 extern uint32_t packet_discard_count;
 extern uint32_t packet_bad_cksum_count;
 extern uint32_t packet_rx_count;
 extern uint32_t packet_tx_count;
+extern uint32_t packet_sink_lookup_count;
+extern uint32_t ipv4_reassembly_failures;
 
 struct packet_t {
     packet_t *next;               // used by packet_queue_t to create linked lists
@@ -40,8 +47,12 @@ struct packet_t {
     udp_header_t *udp;            // set for ipv4 udp
     tcp_header_t *tcp;            // set for ipv4 tcp
     icmp_header_t *icmp;          // set for ipv4 icmp
+    igmp_header_t *igmp;          // set for ipv4 igmp
     uint16_t data_length;         // set for ipv4 udp, tcp
     uint8_t *data;                // set for ipv4 udp, tcp
+    uint32_t rx_sum;              // one's complement sum of the entire frame, unfolded, if packet_flag_rx_sum_valid
+    uint8_t *steered_data;        // when set, udp data beyond NET_STEER_PEEK bytes was received here (see net_eth_steer)
+    uint8_t *reassembly_buffer;   // when set, the udp header and data of a reassembled datagram are here (ipv4.c)
     uint16_t buffer_length_alloc; // length allocated for buffer[]
     uint16_t buffer_length;       // length used by buffer[] (buffer_length <= length_alloc)
     uint8_t buffer[];             // must be final member of data structure
@@ -49,6 +60,8 @@ struct packet_t {
 
 static const uint32_t packet_flag_destination_mac_valid = 1;
 static const uint32_t packet_flag_nexthop_resolved = 2;
+static const uint32_t packet_flag_checksums_valid = 4;     // net_tx need not compute checksums
+static const uint32_t packet_flag_rx_sum_valid = 8;        // rx_sum holds the sum of the received frame
 
 struct __attribute__((packed, aligned(2))) ethernet_header_t {
     macaddr_t destination_mac;
@@ -93,6 +106,7 @@ struct __attribute__((packed, aligned(2))) ipv4_header_t {
 };
 
 static const uint8_t ip_proto_icmp = 1;
+static const uint8_t ip_proto_igmp = 2;
 static const uint8_t ip_proto_tcp  = 6;
 static const uint8_t ip_proto_udp  = 17;
 
@@ -112,21 +126,49 @@ struct __attribute__((packed, aligned(2))) icmp_header_t {
     uint8_t payload[];          // finally we get to the actual user data
 };
 
+struct __attribute__((packed, aligned(2))) igmp_header_t {
+    uint8_t type;               // igmp_type_*
+    uint8_t max_response_time;  // queries only, in 1/10 seconds
+    uint16_t checksum;
+    uint32_t group;
+};
+
+static const uint8_t igmp_type_query = 0x11;
+static const uint8_t igmp_type_v1_report = 0x12;
+static const uint8_t igmp_type_v2_report = 0x16;
+static const uint8_t igmp_type_leave = 0x17;
+
 struct __attribute__((packed, aligned(2))) tcp_header_t {
     uint16_t source_port;
     uint16_t destination_port;
     uint32_t sequence;
     uint32_t ack;
-    uint8_t data_offset;
+    uint8_t data_offset;        // top 4 bits = header length in 32-bit words
+    uint8_t flags;              // tcp_flag_*
     uint16_t window_size;
-    uint16_t checksum;
-    // optional urgent pointer
+    uint16_t checksum;          // one's complement sum of pseudo-header, header and data
+    uint16_t urgent_pointer;
     uint8_t options[];          // variable length
     // followed by the user data
 };
 
+static const uint8_t tcp_flag_fin = 0x01;
+static const uint8_t tcp_flag_syn = 0x02;
+static const uint8_t tcp_flag_rst = 0x04;
+static const uint8_t tcp_flag_psh = 0x08;
+static const uint8_t tcp_flag_ack = 0x10;
+
 #define PACKET_MAXLEN 1536      /* largest size we will process */
+#define ETHERNET_MTU 1500       /* largest IPv4 packet we will send */
+#define UDP_MAX_PAYLOAD (ETHERNET_MTU - sizeof(ipv4_header_t) - sizeof(udp_header_t)) /* 1472 */
+#define TCP_MSS (ETHERNET_MTU - sizeof(ipv4_header_t) - sizeof(tcp_header_t))     /* 1460 */
 #define DEFAULT_TTL 64
+#define IPV4_REASSEMBLY_MAX 8704 /* largest fragmented IPv4 payload we will reassemble */
+
+/* the driver reads this much of each frame (ethernet, IPv4, UDP headers plus
+ * NET_STEER_PEEK bytes of data) before asking where to put the rest */
+#define NET_STEER_PEEK 4
+#define NET_STEER_HEADER (sizeof(ethernet_header_t) + sizeof(ipv4_header_t) + sizeof(udp_header_t) + NET_STEER_PEEK)
 
 struct packet_queue_t {
     packet_t *head;
@@ -134,7 +176,10 @@ struct packet_queue_t {
 };
 
 struct packet_sink_t {
-    packet_sink_t *next; // for linked lists
+    packet_sink_t *next;       // for linked lists
+    packet_sink_t *demux_next; // hash chain or wildcard list (net.c)
+    packet_sink_t *ready_next; // list of sinks with packets queued (net.c)
+    bool ready;                // on the ready list
     void *sink_private;  // for sink's use
 
     bool match_interface_local_ip; // similar to match_local_ip, but using the current 'interface_ipv4_address'
@@ -148,39 +193,74 @@ struct packet_sink_t {
     uint32_t packets_queued;
     packet_queue_t queue;
     void (*cb_packet_received)(packet_sink_t *sink, packet_t *packet);
+    // optional: called from the driver with only NET_STEER_HEADER bytes of a UDP
+    // packet received; may return a (16-bit aligned) buffer to receive the
+    // remaining 'length' bytes of data directly, avoiding a copy. The packet is
+    // still delivered to cb_packet_received, with packet->steered_data set.
+    uint8_t *(*cb_steer_payload)(packet_sink_t *sink, packet_t *packet, int length);
 
     timer_t timer;
     void (*cb_timer_expired)(packet_sink_t *sink);
 };
 
 /* ne2000.c */
+typedef struct {
+    uint32_t rx_overflows;      // receive ring overflowed and was reset
+    uint32_t rx_frame_errors;   // frame alignment errors
+    uint32_t rx_crc_errors;
+    uint32_t rx_missed;         // frames the card had no room for
+    uint32_t tx_collisions;
+    uint32_t tx_aborted;        // gave up after 16 collisions
+    uint32_t tx_full;           // transmits deferred to net_txqueue because every Tx slot was busy
+} eth_counters_t;
+
 bool eth_init(void); // returns true if card found
 void eth_halt(void);
 void eth_pump(void); // called from net_pump
 bool eth_attempt_tx(packet_t *packet); // returns true if transmission started; caller must free packet.
 int eth_rxbuffer_size(void); // in bytes
+int eth_rxbuffer_max_size(void); // in bytes, if eth_set_tx_slots(1) were used
+int eth_set_tx_slots(int slots); // repartition card memory between Tx slots and Rx ring; returns slots used
+uint32_t eth_overflow_count(void); // receive ring overflows since counters were reset
+int eth_tx_slots(void); // frames the card can hold queued for transmit
+const eth_counters_t *eth_counters(void); // cumulative, including the card's tally registers
+void eth_counters_reset(void);
+void eth_set_multicast_list(const macaddr_t *list, int count); // groups to receive, in addition to our MAC and broadcast
 
 /* net.c -- interface with ne2000.c */
 void net_eth_push(packet_t *packet);
+int net_eth_steer(packet_t *packet, int length); // returns number of bytes to receive into packet->steered_data
 packet_t *net_eth_pull(void);
 void net_add_packet_sink(packet_sink_t *c);
 void net_remove_packet_sink(packet_sink_t *c);
 
 /* net.c */
 void net_init(void);
+void net_counters_reset(void); // used by "netinfo reset"
 void net_pump(void);
 void net_tx(packet_t *packet);
+void net_tx_resolved(packet_t *packet); // destination MAC already set: straight to the card or net_txqueue
 void net_dump_packet_sinks(void);
 
 /* packet.c, ipv4.c */
-packet_t *packet_alloc(int buffer_size);
+void packet_pool_init(void); // call after eth_init
+packet_t *packet_alloc(int buffer_size); // returns NULL when the pool is exhausted
 packet_t *packet_create_tcp(uint32_t dest_ipv4, uint16_t destination_port, uint16_t source_port, int data_size);
 packet_t *packet_create_udp(uint32_t dest_ipv4, uint16_t destination_port, uint16_t source_port, int data_size);
 packet_t *packet_create_icmp(uint32_t dest_ipv4, int data_size);
+packet_t *packet_create_igmp(uint32_t dest_ipv4);
 packet_t *packet_create_for_sink(packet_sink_t *sink, int data_size);
 bool packet_data_resize(packet_t *packet, int new_data_length);
 void packet_free(packet_t *packet);
 uint32_t net_parse_ipv4(const char *str);
+char *net_format_ipv4(char *buffer, uint32_t address); // buffer needs 16 bytes
+
+/* ipv4.c -- fragment reassembly, UDP only */
+void net_ipv4_reassembly_init(void);
+int net_ipv4_reassembly_max(void); // largest payload we can reassemble, or 0
+packet_t *net_ipv4_reassemble(packet_t *packet); // returns the whole datagram, once complete
+void net_ipv4_reassembly_expire(void); // called from net_pump
+void net_ipv4_reassembly_release(packet_t *packet); // called from packet_free
 void packet_set_destination_mac(packet_t *packet, const macaddr_t *mac);
 
 // for dynamically allocated queues
@@ -197,28 +277,80 @@ packet_t *packet_queue_pophead(packet_queue_t *q);
 packet_sink_t *packet_sink_alloc(void);
 void packet_sink_free(packet_sink_t *s);
 
+uint32_t ip_checksum_add(uint32_t sum, const void *data, unsigned int length); // cksum.s
+uint16_t net_checksum_adjust(uint16_t checksum, uint16_t old_word, uint16_t new_word);
+uint16_t net_checksum_adjust32(uint16_t checksum, uint32_t old_long, uint32_t new_long);
 void net_compute_ipv4_checksum(packet_t *packet);
 void net_compute_icmp_checksum(packet_t *packet);
+void net_compute_igmp_checksum(packet_t *packet);
 void net_compute_udp_checksum(packet_t *packet);
 void net_compute_tcp_checksum(packet_t *packet);
 
 bool net_verify_ipv4_checksum(packet_t *packet);
 bool net_verify_icmp_checksum(packet_t *packet);
+bool net_verify_igmp_checksum(packet_t *packet);
 bool net_verify_udp_checksum(packet_t *packet);
 bool net_verify_tcp_checksum(packet_t *packet);
 
 /* dhcp.c */
 void dhcp_init(void);
+bool dhcp_running(void); // false when there is no network interface
+bool dhcp_bound(void); // we have a lease
 
 /* icmp.c */
 void net_icmp_init(void);
 
+/* igmp.c */
+void net_igmp_init(void);
+bool net_multicast_join(uint32_t group); // returns false if we are in too many groups
+void net_multicast_leave(uint32_t group);
+void net_multicast_macaddr(uint32_t group, macaddr_t *mac);
+
 /* arp.c */
 typedef enum { arp_okay, arp_wait, arp_fail } arp_result_t;
 void net_arp_init(void);
-arp_result_t net_arp_resolve(packet_t *packet);
+arp_result_t net_arp_resolve(packet_t *packet); // on arp_wait the packet is queued until resolved
+void net_arp_learn(uint32_t ip, macaddr_t *mac);
+void net_arp_announce(void); // gratuitous ARP for our address
+
+/* tcp.c -- a single client connection at a time */
+typedef enum { tcp_closed, tcp_syn_sent, tcp_established, tcp_fin_wait_1, tcp_fin_wait_2,
+               tcp_close_wait, tcp_closing, tcp_last_ack } tcp_state_t;
+typedef bool (*tcp_receive_cb_t)(void *cb_private, const uint8_t *data, int length); // return false to abort
+bool tcp_connect(uint32_t remote_ip, uint16_t remote_port, tcp_receive_cb_t cb_receive, void *cb_private);
+int tcp_send(const void *data, int length); // returns bytes accepted, or -1 if the connection is not open for sending
+void tcp_close(void); // FIN once queued data has been sent
+void tcp_abort(void); // RST
+tcp_state_t tcp_state(void);
+bool tcp_was_reset(void); // closed by RST or timeout rather than an orderly close
+bool tcp_peer_closed(void); // peer has sent FIN; no more data will arrive
+
+/* netconsole.c */
+void netconsole_start(uint32_t ip, uint16_t port, bool uart_output); // port 0 for the default
+void netconsole_stop(void);
+void netconsole_report(void);
+
+/* http.c */
+bool http_get(const char *url, const char *disk_filename);
+bool http_get_memory(const char *url, uint32_t address, uint32_t length);
 
 /* tftp.c */
-bool tftp_transfer(uint32_t tftp_server_ip, const char *tftp_filename, const char *disk_filename, bool is_put);
+typedef bool (*tftp_receive_cb_t)(void *cb_private, const uint8_t *data, int length); // return false to abort
+typedef void *(*tftp_locate_cb_t)(void *cb_private, uint32_t ahead, int length); // final address of data not yet passed to tftp_receive_cb_t, or NULL
+#define TFTP_PUT        1 // send rather than receive
+#define TFTP_MULTICAST  2 // get: RFC 2090; falls back to unicast
+#define TFTP_BACKGROUND 4 // run as a job (task.h) and return once started
+bool tftp_transfer_file(uint32_t tftp_server_ip, const char *tftp_filename, const char *disk_filename, int flags);
+bool tftp_transfer_memory(uint32_t tftp_server_ip, const char *tftp_filename, uint32_t address, uint32_t length, int flags);
+typedef struct {
+    const char *tftp_filename;
+    const char *disk_filename;    // NULL to receive to memory
+    uint32_t address, length;
+} tftp_request_t;
+bool tftp_get_many(uint32_t tftp_server_ip, const tftp_request_t *requests, int count); // concurrently
+bool tftp_receive(uint32_t tftp_server_ip, const char *tftp_filename, tftp_receive_cb_t cb_receive, tftp_locate_cb_t cb_locate, void *cb_private);
+void tftp_server_enable(bool enable); // serve RRQs on port 69 from disk and "mem/ADDRESS/LENGTH"
+bool tftp_server_enabled(void);
+int tftp_server_transfers(void); // transfers in progress
 
 #endif
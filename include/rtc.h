@@ -14,4 +14,12 @@ void rtc_read_clock(rtc_time_t *buffer);
 void rtc_init(void);
 void report_current_time(void);
 
+/* a little battery-backed RAM for our own use, at least 31 bytes */
+int rtc_nvram_size(void);
+uint8_t rtc_nvram_read(int offset);
+void rtc_nvram_write(int offset, uint8_t value);
+
+/* layout of rtc_nvram */
+#define RTC_NVRAM_DHCP_LEASE    0   /* 6 bytes, net/dhcp.c */
+
 #endif
@@ -0,0 +1,28 @@
+#ifndef __TASK_DOT_H__
+#define __TASK_DOT_H__
+
+#include <types.h>
+
+/* cooperative background jobs, run from net_pump() */
+typedef struct task_t task_t;
+typedef bool (*task_poll_cb_t)(task_t *task); /* do some work; return true when finished */
+
+struct task_t {
+    task_t *next;
+    int id;                 /* job number shown to the user */
+    char *name;
+    task_poll_cb_t cb_poll;
+    void *task_private;
+    int progress;           /* bytes done so far, for "jobs" */
+    bool finished;
+    bool success;           /* set by cb_poll before it returns true */
+};
+
+task_t *task_create(const char *name, task_poll_cb_t cb_poll, void *task_private);
+task_t *task_find(int id);
+void task_pump(void);       /* called from net_pump() */
+int task_running(void);     /* number of unfinished tasks */
+bool task_wait(task_t *task); /* NULL waits for all; returns false if any failed or the user cancelled */
+void task_list(void);       /* print tasks, forgetting those that have finished */
+
+#endif
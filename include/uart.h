@@ -27,6 +27,9 @@ uint8_t uart_read_byte_wait(void); /* waits if not ready */
 void uart_read_string(void *buffer, int count);
 bool uart_check_cancel_key(void);
 
+/* output and input for a second console; the UART output can be switched off */
+void uart_set_console_hooks(void (*write_hook)(char b), int (*read_hook)(void), bool uart_output);
+
 /* 16550 UART hardware registers */
 #define UART_THR        0       /* transmit holding register */
 #define UART_RBR        0       /* receive buffer register */
@@ -8,10 +8,13 @@
 #undef ARP_DEBUG
 
 #define CACHE_TIMEOUT   60
-#define CACHE_FLUSH_INTERVAL 15
+#define FAILED_TIMEOUT  15  // how long we remember that a host did not answer
 #define MAX_RESOLVE_ATTEMPTS 10
 #define QUERY_INTERVAL 500
 
+#define CACHE_SIZE      16
+#define CACHE_BUCKETS   8   // must be a power of 2
+
 #define HARDWARE_TYPE_ETHERNET 1
 #define PROTOCOL_TYPE_IPV4 0x800
 
@@ -20,19 +23,94 @@ static packet_sink_t *sink;
 typedef struct arp_cache_entry_t arp_cache_entry_t;
 
 struct arp_cache_entry_t {
-    arp_cache_entry_t *next;
+    arp_cache_entry_t *next;    // hash bucket chain, or free list
     uint32_t ipv4_address;
     macaddr_t mac_address;
     bool valid;
-    int resolve_attempts;
-    timer_t next_event;
+    int resolve_attempts;       // > MAX_RESOLVE_ATTEMPTS once resolution has failed
+    timer_t next_event;         // expiry when valid, otherwise next query
+    packet_queue_t pending;     // packets waiting for this entry to resolve
 };
 
-static arp_cache_entry_t *cache_list_head;
+static arp_cache_entry_t cache_entries[CACHE_SIZE];
+static arp_cache_entry_t *cache_bucket[CACHE_BUCKETS];
+static arp_cache_entry_t *cache_free_list;
+
+static arp_cache_entry_t **cache_bucket_for(uint32_t ip)
+{
+    return &cache_bucket[(ip ^ (ip >> 8)) & (CACHE_BUCKETS-1)];
+}
+
+static arp_cache_entry_t *cache_lookup(uint32_t ip)
+{
+    arp_cache_entry_t *entry;
+
+    for(entry = *cache_bucket_for(ip); entry; entry = entry->next)
+        if(entry->ipv4_address == ip)
+            return entry;
+
+    return NULL;
+}
+
+static void cache_remove(arp_cache_entry_t *entry)
+{
+    arp_cache_entry_t **ptr = cache_bucket_for(entry->ipv4_address);
+
+    while(*ptr != entry)
+        ptr = &(*ptr)->next;
+    *ptr = entry->next;
+
+    packet_queue_drain(&entry->pending);
+    entry->next = cache_free_list;
+    cache_free_list = entry;
+}
+
+// make sure the sink timer fires no later than 'when'
+static void arp_schedule(timer_t when)
+{
+    if(!sink->timer || ((when - sink->timer) & 0x80000000))
+        sink->timer = when;
+}
+
+static arp_cache_entry_t *cache_insert(uint32_t ip)
+{
+    arp_cache_entry_t *entry, *victim = NULL;
+    arp_cache_entry_t **bucket;
+
+    if(!cache_free_list){
+        // full: evict the entry nearest to expiry that has no packets waiting on it
+        for(entry = cache_entries; entry < &cache_entries[CACHE_SIZE]; entry++)
+            if(!entry->pending.head &&
+               (!victim || ((entry->next_event - victim->next_event) & 0x80000000)))
+                victim = entry;
+        if(!victim)
+            return NULL;
+#ifdef ARP_DEBUG
+        printf("arp: evicting entry for ip 0x%08lx\n", victim->ipv4_address);
+#endif
+        cache_remove(victim);
+    }
+
+    entry = cache_free_list;
+    cache_free_list = entry->next;
+
+    bucket = cache_bucket_for(ip);
+    entry->next = *bucket;
+    *bucket = entry;
+    entry->ipv4_address = ip;
+    entry->valid = false;
+    entry->resolve_attempts = 0;
+    memset(entry->mac_address, 0, sizeof(macaddr_t));
+    packet_queue_init(&entry->pending);
+
+    return entry;
+}
 
 static packet_t *packet_create_arp(void)
 {
     packet_t *p = packet_alloc(sizeof(ethernet_header_t) + sizeof(arp_header_t));
+    if(!p)
+        return NULL;
 
     // set up ethernet header
     memcpy(&p->eth->source_mac, interface_macaddr, sizeof(macaddr_t));
@@ -52,14 +130,8 @@ static packet_t *packet_create_arp(void)
 
 static void update_arp_cache(uint32_t ip, macaddr_t *mac, bool add_entry)
 {
-    arp_cache_entry_t *entry = cache_list_head;
-
-    while(entry){
-        if(entry->ipv4_address == ip)
-            break;
-        else
-            entry = entry->next;
-    }
+    packet_t *packet;
+    arp_cache_entry_t *entry = cache_lookup(ip);
 
     if(entry == NULL){
 #ifdef ARP_DEBUG
@@ -70,19 +142,25 @@ static void update_arp_cache(uint32_t ip, macaddr_t *mac, bool add_entry)
 #ifdef ARP_DEBUG
         printf("arp: creating entry for ip 0x%08lx\n", ip);
 #endif
-        entry = malloc(sizeof(arp_cache_entry_t));
-        entry->next = cache_list_head;
-        cache_list_head = entry;
+        entry = cache_insert(ip);
+        if(!entry)
+            return;
     }
 
 #ifdef ARP_DEBUG
     printf("arp: updating entry for ip 0x%08lx\n", ip);
 #endif
-    entry->ipv4_address = ip;
     memcpy(entry->mac_address, mac, sizeof(macaddr_t));
     entry->valid = true;
     entry->resolve_attempts = 0;
     entry->next_event = set_timer_sec(CACHE_TIMEOUT);
+    arp_schedule(entry->next_event);
+
+    // release anything that was waiting for this address
+    while((packet = packet_queue_pophead(&entry->pending))){
+        packet_set_destination_mac(packet, &entry->mac_address);
+        net_tx_resolved(packet);
+    }
 }
 
 static void arp_process_packet(packet_sink_t *sink, packet_t *packet)
@@ -105,11 +183,13 @@ static void arp_process_packet(packet_sink_t *sink, packet_t *packet)
 #endif
                     // this was for us; generate an ARP reply
                     packet_t *reply = packet_create_arp();
-                    reply->arp->operation = arp_op_reply;
-                    reply->arp->target_ip = packet->arp->sender_ip;
-                    memcpy(reply->arp->target_mac, packet->arp->sender_mac, sizeof(macaddr_t));
-                    packet_set_destination_mac(reply, &reply->arp->target_mac);
-                    net_tx(reply);
+                    if(reply){
+                        reply->arp->operation = arp_op_reply;
+                        reply->arp->target_ip = packet->arp->sender_ip;
+                        memcpy(reply->arp->target_mac, packet->arp->sender_mac, sizeof(macaddr_t));
+                        packet_set_destination_mac(reply, &reply->arp->target_mac);
+                        net_tx(reply);
+                    }
                     // additionally, add the sender to our ARP cache if not already present
                     add_entry = true;
                 }
@@ -133,48 +213,15 @@ static void arp_process_packet(packet_sink_t *sink, packet_t *packet)
     packet_free(packet);
 }
 
-static void arp_cache_flush(packet_sink_t *sink)
-{
-    int total = 0, expired = 0;
-
-    arp_cache_entry_t *entry = cache_list_head, *next;
-    arp_cache_entry_t **entry_ptr = &cache_list_head;
-
-    sink->timer = set_timer_sec(CACHE_FLUSH_INTERVAL);
-
-    while(entry){
-        total++;
-        if((entry->valid && timer_expired(entry->next_event)) || // valid but timed out
-           (!entry->valid && entry->resolve_attempts >= MAX_RESOLVE_ATTEMPTS)){ // resolve failed
-            // dead -- remove entry
-#ifdef ARP_DEBUG
-            printf("arp: flushing %svalid entry for ip 0x%08lx\n", 
-                    entry->valid ? "":"in", entry->ipv4_address);
-#endif
-            expired++;
-            next = entry->next; // stash this now, before we free this entry
-            *entry_ptr = entry->next;
-            free(entry);
-            entry = next;
-            // do not update entry_ptr
-        }else{
-            // walk list
-            entry_ptr = &entry->next;
-            entry = entry->next;
-        }
-    }
-
-#ifdef ARP_DEBUG
-    printf("arp: flushed cache, %d total, %d expired\n", total, expired);
-#endif
-}
-
 static void arp_transmit_query(arp_cache_entry_t *entry)
 {
     entry->resolve_attempts++;
     entry->next_event = set_timer_ms(QUERY_INTERVAL);
+    arp_schedule(entry->next_event);
 
     packet_t *query = packet_create_arp();
+    if(!query) // try again at the next interval
+        return;
     query->arp->operation = arp_op_request;
     query->arp->target_ip = htonl(entry->ipv4_address);
     memset(query->arp->target_mac, 0, sizeof(macaddr_t));
@@ -186,9 +233,44 @@ static void arp_transmit_query(arp_cache_entry_t *entry)
     net_tx(query);
 }
 
+// called when the earliest entry event is due: expire, re-query or give up
+static void arp_timer(packet_sink_t *sink)
+{
+    arp_cache_entry_t *entry;
+    int b;
+
+    sink->timer = 0;
+
+    for(b=0; b<CACHE_BUCKETS; b++){
+        entry = cache_bucket[b];
+        while(entry){
+            arp_cache_entry_t *next = entry->next; // entry may be removed
+            if(timer_expired(entry->next_event)){
+                if(entry->valid || entry->resolve_attempts > MAX_RESOLVE_ATTEMPTS){
+#ifdef ARP_DEBUG
+                    printf("arp: flushing %svalid entry for ip 0x%08lx\n",
+                            entry->valid ? "":"in", entry->ipv4_address);
+#endif
+                    cache_remove(entry);
+                    entry = next;
+                    continue;
+                }else if(entry->resolve_attempts == MAX_RESOLVE_ATTEMPTS){
+                    // resolve failed: drop the waiting packets, remember for a while
+                    packet_queue_drain(&entry->pending);
+                    entry->resolve_attempts++;
+                    entry->next_event = set_timer_sec(FAILED_TIMEOUT);
+                }else
+                    arp_transmit_query(entry);
+            }
+            arp_schedule(entry->next_event);
+            entry = next;
+        }
+    }
+}
+
 arp_result_t net_arp_resolve(packet_t *packet)
 {
-    arp_cache_entry_t *entry = cache_list_head;
+    arp_cache_entry_t *entry;
 
     // no ARP required for broadcast
     if(packet->ipv4 && (
@@ -198,23 +280,14 @@ arp_result_t net_arp_resolve(packet_t *packet)
         return arp_okay;
     }
 
-    while(entry){
-        if(entry->ipv4_address == packet->ipv4_nexthop)
-            break;
-        entry = entry->next;
-    }
+    entry = cache_lookup(packet->ipv4_nexthop);
 
     if(!entry){
         // allocate a new entry and begin resolution
-        entry = malloc(sizeof(arp_cache_entry_t));
-        memset(entry->mac_address, 0, sizeof(macaddr_t));
-        entry->next = cache_list_head;
-        cache_list_head = entry;
-        entry->ipv4_address = packet->ipv4_nexthop;
-        entry->valid = false;
-        entry->resolve_attempts = 0;
+        entry = cache_insert(packet->ipv4_nexthop);
+        if(!entry) // every entry is busy resolving
+            return arp_fail;
         arp_transmit_query(entry);
-        return arp_wait;
     }
 
     if(entry->valid){
@@ -222,23 +295,44 @@ arp_result_t net_arp_resolve(packet_t *packet)
         return arp_okay;
     }
 
-    if(timer_expired(entry->next_event)){
-        if(entry->resolve_attempts >= MAX_RESOLVE_ATTEMPTS){
-            return arp_fail;
-        }
-        arp_transmit_query(entry);
-    }
+    if(entry->resolve_attempts > MAX_RESOLVE_ATTEMPTS)
+        return arp_fail;
 
+    // update_arp_cache() sends it on when the answer arrives
+    packet_queue_addtail(&entry->pending, packet);
     return arp_wait;
 }
 
+void net_arp_learn(uint32_t ip, macaddr_t *mac)
+{
+    update_arp_cache(ip, mac, true);
+}
+
+void net_arp_announce(void)
+{
+    packet_t *announce = packet_create_arp();
+    if(!announce)
+        return;
+    // gratuitous ARP: a request for our own address, so neighbours refresh their caches
+    announce->arp->operation = arp_op_request;
+    announce->arp->target_ip = htonl(interface_ipv4_address);
+    memset(announce->arp->target_mac, 0, sizeof(macaddr_t));
+    packet_set_destination_mac(announce, &broadcast_macaddr);
+    net_tx(announce);
+}
+
 void net_arp_init(void)
 {
-    cache_list_head = NULL;
+    cache_free_list = NULL;
+    for(int i=0; i<CACHE_SIZE; i++){
+        cache_entries[i].next = cache_free_list;
+        cache_free_list = &cache_entries[i];
+    }
+    for(int i=0; i<CACHE_BUCKETS; i++)
+        cache_bucket[i] = NULL;
     sink = packet_sink_alloc();
     sink->match_ethertype = ethertype_arp;
     sink->cb_packet_received = arp_process_packet;
-    sink->timer = set_timer_sec(CACHE_FLUSH_INTERVAL);
-    sink->cb_timer_expired = arp_cache_flush;
+    sink->cb_timer_expired = arp_timer;
     net_add_packet_sink(sink);
 }
@@ -0,0 +1,88 @@
+/* Internet checksum (RFC 1071) inner loop for m68k
+ *
+ * uint32_t ip_checksum_add(uint32_t sum, const void *data, unsigned int length)
+ *
+ * Adds 'length' bytes at 'data' (which must be 16-bit aligned) into the
+ * one's complement accumulator 'sum', 32 bits at a time, using addx.l to
+ * carry from one long into the next. An odd final byte is padded with zero.
+ * The result must still be folded to 16 bits and complemented.
+ *
+ * The loop is unrolled, and entered part way through the first pass to
+ * deal with the longs that do not make up a whole block. 68020 and later
+ * have an instruction cache which the 8 long loop fits in comfortably. The
+ * 68000 has no cache, so we unroll further and, lacking scaled indexing,
+ * pre-scale the jump offset.
+ */
+
+        .globl  ip_checksum_add
+
+        .text
+        .even
+
+.ifdef TARGET_MINI
+        .equ    UNROLL_SHIFT, 4         /* 16 longs per pass */
+.else
+        .equ    UNROLL_SHIFT, 3         /* 8 longs per pass */
+.endif
+
+ip_checksum_add:
+    movel %sp@(4),%d0           /* uint32_t sum */
+    moveal %sp@(8),%a0          /* const void *data */
+    movel %sp@(12),%d1          /* unsigned int length */
+
+    /* save registers */
+    movem.l %d2-%d3,-(%sp)
+
+    movel %d1,%d2
+    lsrl #2,%d2                 /* number of longs */
+    moveq #(1<<UNROLL_SHIFT)-1,%d3
+    andl %d2,%d3                /* longs in the partial first pass */
+    lsrl #UNROLL_SHIFT,%d2      /* number of whole passes */
+    negl %d3
+.ifdef TARGET_MINI
+    addl %d3,%d3                /* each movel/addxl pair is 4 bytes */
+    addl %d3,%d3
+.endif
+    lea %pc@(csum_pass_end),%a1
+    andib #0xef,%ccr            /* clear X before the first addxl */
+.ifdef TARGET_MINI
+    jmp %a1@(0,%d3:w)
+.else
+    jmp %a1@(0,%d3:w:4)
+.endif
+
+csum_pass:
+    .rept 1<<UNROLL_SHIFT
+    movel %a0@+,%d1             /* movel leaves X alone */
+    addxl %d1,%d0
+    .endr
+csum_pass_end:
+    dbra %d2,csum_pass          /* dbra leaves X alone too */
+
+    /* fold in the final carry; twice, in case that carries as well */
+    moveq #0,%d2
+    addxl %d2,%d0
+    addxl %d2,%d0
+
+    /* trailing word and byte */
+    movel %sp@(20),%d1          /* length (8 bytes of saved registers) */
+    btst #1,%d1
+    beq csum_no_word
+    moveq #0,%d3
+    movew %a0@+,%d3
+    addl %d3,%d0
+    addxl %d2,%d0
+csum_no_word:
+    btst #0,%d1
+    beq csum_done
+    moveq #0,%d3
+    moveb %a0@,%d3
+    lslw #8,%d3                 /* high half of a zero padded word */
+    addl %d3,%d0
+    addxl %d2,%d0
+
+csum_done:
+    /* restore registers, return */
+    movem.l (%sp)+,%d2-%d3
+    rts
+        .end
@@ -5,11 +5,13 @@
 #include <timers.h>
 #include <cli.h>
 #include <net.h>
+#include <rtc.h>
 #include "dhcp_internals.h"
 
 #undef DHCP_DEBUG
 
 const int renew_retry_count = 100;
+const int reboot_retry_count = 3; // one second apart
 int select_wait_time = short_wait_time;
 
 static uint32_t dhcp_server_id;
@@ -18,6 +20,11 @@ static uint32_t dhcp_offer_subnet_mask;
 static uint32_t dhcp_offer_gateway;
 static uint32_t dhcp_offer_dns_server;
 static uint32_t dhcp_offer_lease_time;
+static uint32_t dhcp_offer_next_server;  // option 66 if it is an address, otherwise siaddr
+static char dhcp_offer_bootfile[128];   // option 67, otherwise the BOOTP file field
+static bool dhcp_rapid_commit;      // reply carried the Rapid Commit option
+static uint32_t dhcp_reboot_address; // saved lease we ask for in DHCP_REBOOT
+static timer_t dhcp_start_time;     // when we started looking for a lease
 int renew_retry_remaining;
 
 static dhcp_state_t dhcp_state;
@@ -27,8 +34,11 @@ static packet_sink_t *sink;
 uint8_t const discover_options[] = {
     // DHCP message type - DHCPDISCOVER
     dhcp_opt_message_type,  0x01, dhcp_type_discover,
-    // DHCP parameter request list (1=subnet mask, 3=router, 6=nameserver, 15=domain name)
-    dhcp_opt_param_request, 0x04, 0x01, 0x03, 0x06, 0x0f,
+    // DHCP parameter request list (1=subnet mask, 3=router, 6=nameserver, 15=domain name,
+    // 66=TFTP server name, 67=bootfile name)
+    dhcp_opt_param_request, 0x06, 0x01, 0x03, 0x06, 0x0f, 0x42, 0x43,
+    // Rapid Commit: a server may answer with an ACK straight away (RFC 4039)
+    dhcp_opt_rapid_commit,  0x00,
 };
 
 uint8_t const dhcp_always_options[] = {
@@ -53,6 +63,8 @@ static packet_t *packet_create_dhcp(uint32_t target_ipv4, uint8_t message_type,
 
     packet_t *p = packet_create_udp(target_ipv4, 67, 68,
             sizeof(dhcp_message_t) + options_len);
+    if(!p)
+        return NULL;
 
     dhcp_message_t *d = (dhcp_message_t*)p->data;
 
@@ -83,20 +95,27 @@ static packet_t *packet_create_dhcp(uint32_t target_ipv4, uint8_t message_type,
     return p;
 }
 
-static void dhcp_send_request(void)
+// server_id is left out when 0, as it must be for INIT-REBOOT
+static void dhcp_send_request(uint32_t requested_ip, uint32_t server_id)
 {
     unsigned char req_opt[32];
     int req_opt_len = 0;
 
     req_opt[req_opt_len++] = dhcp_opt_requested_ip;
     req_opt[req_opt_len++] = 4;
-    *((uint32_t*)(req_opt+req_opt_len)) = htonl(dhcp_offer_ipv4_address);
+    *((uint32_t*)(req_opt+req_opt_len)) = htonl(requested_ip);
     req_opt_len += 4;
 
-    req_opt[req_opt_len++] = dhcp_opt_server_id;
-    req_opt[req_opt_len++] = 4;
-    *((uint32_t*)(req_opt+req_opt_len)) = htonl(dhcp_server_id);
-    req_opt_len += 4;
+    if(server_id){
+        req_opt[req_opt_len++] = dhcp_opt_server_id;
+        req_opt[req_opt_len++] = 4;
+        *((uint32_t*)(req_opt+req_opt_len)) = htonl(server_id);
+        req_opt_len += 4;
+    }
+
+    // ask for the same parameters as in the DHCPDISCOVER
+    memcpy(req_opt+req_opt_len, discover_options + 3, 8);
+    req_opt_len += 8;
 
     // the DHCPREQUEST should also go to the broadcast address
     packet_t *req = packet_create_dhcp(ipv4_broadcast, dhcp_type_request,
@@ -105,10 +124,71 @@ static void dhcp_send_request(void)
     net_tx(req);
 }
 
+/* The last lease is kept in RTC NVRAM so the next boot can go straight to
+ * INIT-REBOOT and ask for the same address, which takes one round trip
+ * instead of DISCOVER/OFFER/REQUEST/ACK. Layout: magic, checksum, then the
+ * IP address, big-endian. Nothing else is worth keeping: INIT-REBOOT must not
+ * name a server, and the server's ACK tells us the lease time afresh. */
+#define LEASE_MAGIC     0xd4
+#define LEASE_SIZE      6
+
+static uint8_t lease_checksum(const uint8_t *record)
+{
+    uint8_t sum = 0;
+    for(int i=2; i<LEASE_SIZE; i++)
+        sum += record[i];
+    return ~sum;
+}
+
+static void lease_put32(uint8_t *p, uint32_t value)
+{
+    for(int i=0; i<4; i++)
+        p[i] = value >> (24 - 8*i);
+}
+
+static uint32_t lease_get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t dhcp_load_lease(void)
+{
+    uint8_t record[LEASE_SIZE];
+
+    if(rtc_nvram_size() < RTC_NVRAM_DHCP_LEASE + LEASE_SIZE)
+        return 0;
+
+    for(int i=0; i<LEASE_SIZE; i++)
+        record[i] = rtc_nvram_read(RTC_NVRAM_DHCP_LEASE + i);
+
+    if(record[0] != LEASE_MAGIC || record[1] != lease_checksum(record))
+        return 0;
+
+    return lease_get32(record+2);
+}
+
+static void dhcp_save_lease(uint32_t address)
+{
+    uint8_t record[LEASE_SIZE];
+
+    if(rtc_nvram_size() < RTC_NVRAM_DHCP_LEASE + LEASE_SIZE)
+        return;
+
+    record[0] = address ? LEASE_MAGIC : 0;
+    lease_put32(record+2, address);
+    record[1] = lease_checksum(record);
+
+    // NVRAM writes are slow on the DS1302; skip those that change nothing
+    for(int i=0; i<LEASE_SIZE; i++)
+        if(rtc_nvram_read(RTC_NVRAM_DHCP_LEASE + i) != record[i])
+            rtc_nvram_write(RTC_NVRAM_DHCP_LEASE + i, record[i]);
+}
+
 bool process_dhcp_reply(packet_t *packet, uint8_t expected_dhcp_type)
 {
-    int offset, length;
+    int offset, length, n;
     uint8_t opt_code, opt_len, *opt_data;
+    char server_name[16];
     dhcp_message_t *d = (dhcp_message_t*)packet->data;
 
 #ifdef DHCP_DEBUG
@@ -118,6 +198,10 @@ bool process_dhcp_reply(packet_t *packet, uint8_t expected_dhcp_type)
     if(d->op != 2) // check for BOOTREPLY
         return false;
 
+    // replies are broadcast; make sure this one is for us
+    if(memcmp(d->chaddr, interface_macaddr, sizeof(macaddr_t)) != 0)
+        return false;
+
     // parse DHCP options
     offset = 4; // skip over magic cookie
     length = packet->data_length - sizeof(dhcp_message_t);
@@ -135,12 +219,17 @@ bool process_dhcp_reply(packet_t *packet, uint8_t expected_dhcp_type)
 #endif
 
     // reset offer state
+    dhcp_rapid_commit = false;
     dhcp_server_id = 0;
     dhcp_offer_lease_time = 0;
     dhcp_offer_subnet_mask = 0;
     dhcp_offer_gateway = 0;
     dhcp_offer_dns_server = 0;
     dhcp_offer_ipv4_address = ntohl(d->yiaddr);
+    dhcp_offer_next_server = ntohl(d->siaddr);
+    // the BOOTP file field is not necessarily NUL terminated; option 67 overrides it
+    memcpy(dhcp_offer_bootfile, d->file, sizeof(dhcp_offer_bootfile)-1);
+    dhcp_offer_bootfile[sizeof(dhcp_offer_bootfile)-1] = 0;
 
     // process DHCP options
     while(offset < length){
@@ -193,6 +282,23 @@ bool process_dhcp_reply(packet_t *packet, uint8_t expected_dhcp_type)
                         return false;
                     dhcp_offer_dns_server = ntohl(*((uint32_t*)opt_data));
                     break;
+                case dhcp_opt_rapid_commit:
+                    dhcp_rapid_commit = true;
+                    break;
+                case dhcp_opt_tftp_server:
+                    // a name, which we can only use if it is a dotted quad (no DNS)
+                    if(opt_len < sizeof(server_name)){
+                        memcpy(server_name, opt_data, opt_len);
+                        server_name[opt_len] = 0;
+                        if(net_parse_ipv4(server_name))
+                            dhcp_offer_next_server = net_parse_ipv4(server_name);
+                    }
+                    break;
+                case dhcp_opt_bootfile:
+                    n = opt_len < sizeof(dhcp_offer_bootfile) ? opt_len : sizeof(dhcp_offer_bootfile)-1;
+                    memcpy(dhcp_offer_bootfile, opt_data, n);
+                    dhcp_offer_bootfile[n] = 0;
+                    break;
                 default:
                     break;
             }
@@ -216,8 +322,16 @@ static void dhcp_enter_state(dhcp_state_t state)
 #endif
 
     switch(dhcp_state){
+        case DHCP_REBOOT:
+            // ask for the address we had last time
+            renew_retry_remaining = reboot_retry_count;
+            sink->timer = set_timer_sec(1);
+            dhcp_send_request(dhcp_reboot_address, 0);
+            break;
         case DHCP_DISCOVER:
             // no lease: reset dhcp and interface state
+            if(interface_ipv4_address)
+                dhcp_start_time = gogoboot_read_timer(); // lost the one we had
             dhcp_offer_dns_server = 0;
             dhcp_offer_gateway = 0;
             dhcp_offer_lease_time = 0;
@@ -246,14 +360,18 @@ static void dhcp_enter_state(dhcp_state_t state)
             sink->timer = set_timer_sec(short_wait_time);
             break;
         case DHCP_BOUND:
-            // relax and wait for our lease to near expiry
-            sink->timer = set_timer_sec(dhcp_offer_lease_time - (renew_retry_count * short_wait_time));
+            // relax and wait for our lease to near expiry; a short lease
+            // leaves no room for every RENEW retry, so renew at half time
+            if(dhcp_offer_lease_time > renew_retry_count * short_wait_time)
+                sink->timer = set_timer_sec(dhcp_offer_lease_time - (renew_retry_count * short_wait_time));
+            else
+                sink->timer = set_timer_sec(dhcp_offer_lease_time / 2);
             break;
         case DHCP_RENEW:
             // periodically send REQUESTs
             renew_retry_remaining = renew_retry_count;
             sink->timer = set_timer_sec(short_wait_time);
-            dhcp_send_request();
+            dhcp_send_request(dhcp_offer_ipv4_address, dhcp_server_id);
             break;
     }
 }
@@ -265,6 +383,14 @@ static void dhcp_timer(packet_sink_t *sink)
 #endif
 
     switch(dhcp_state){
+        case DHCP_REBOOT:
+            renew_retry_remaining--;
+            if(renew_retry_remaining > 0){
+                dhcp_send_request(dhcp_reboot_address, 0);
+                sink->timer = set_timer_sec(1);
+            }else
+                dhcp_enter_state(DHCP_DISCOVER); // nobody answered; do it the long way
+            break;
         case DHCP_DISCOVER:
             // this should not happen; we don't wait around in this state
             break;
@@ -284,7 +410,7 @@ static void dhcp_timer(packet_sink_t *sink)
             // periodically send REQUESTs
             renew_retry_remaining--;
             if(renew_retry_remaining > 0){
-                dhcp_send_request();
+                dhcp_send_request(dhcp_offer_ipv4_address, dhcp_server_id);
                 // reset the timer so we get called again
                 sink->timer = set_timer_sec(short_wait_time);
             }else
@@ -293,6 +419,64 @@ static void dhcp_timer(packet_sink_t *sink)
     }
 }
 
+// Publish the boot server and file as environment variables for tftp,
+// tftpboot and the network autoboot path in cli.c. A value the user has
+// already set is left alone, so a boot script can override the server.
+static void dhcp_set_boot_variables(void)
+{
+    char address[16];
+
+    if(dhcp_offer_next_server && !get_environment_variable("tftp_server"))
+        set_environment_variable("tftp_server", net_format_ipv4(address, dhcp_offer_next_server));
+    if(dhcp_offer_bootfile[0] && !get_environment_variable("bootfile"))
+        set_environment_variable("bootfile", dhcp_offer_bootfile);
+}
+
+// offers, and ACKs we did not ask for with a REQUEST, must pass this
+static bool dhcp_lease_suitable(void)
+{
+    return dhcp_offer_ipv4_address && dhcp_offer_gateway &&
+           dhcp_offer_dns_server && dhcp_offer_lease_time >= 180;
+}
+
+// we have an ACK: configure the interface
+static void dhcp_bind(packet_t *packet)
+{
+    int prefixlen = 0;
+    uint32_t mask, taken;
+    const char *how;
+
+    interface_ipv4_address = dhcp_offer_ipv4_address;
+    interface_subnet_mask = mask = dhcp_offer_subnet_mask;
+    interface_ipv4_gateway = dhcp_offer_gateway;
+    interface_dns_server = dhcp_offer_dns_server;
+    while(mask){
+        prefixlen++;
+        mask <<= 1;
+    }
+    // an on-link server's MAC is right here; saves an ARP round trip
+    if(((ntohl(packet->ipv4->source_ip) ^ interface_ipv4_address) & interface_subnet_mask) == 0)
+        net_arp_learn(ntohl(packet->ipv4->source_ip), &packet->eth->source_mac);
+    dhcp_save_lease(interface_ipv4_address);
+    if(dhcp_state != DHCP_RENEW){ // don't print this on every RENEW
+        net_arp_announce();
+        taken = (gogoboot_read_timer() - dhcp_start_time) * TIMER_MS_PER_TICK;
+        how = (dhcp_state == DHCP_REBOOT) ? ", previous lease" :
+              (dhcp_state == DHCP_SELECT) ? ", rapid commit" : "";
+        printf("DHCP lease acquired (%d.%d.%d.%d/%d, %dh %dm) in %ld.%02lds%s\n",
+                (int)(interface_ipv4_address >> 24 & 0xff),
+                (int)(interface_ipv4_address >> 16 & 0xff),
+                (int)(interface_ipv4_address >>  8 & 0xff),
+                (int)(interface_ipv4_address       & 0xff),
+                prefixlen,
+                (int)(dhcp_offer_lease_time / 3600),
+                (int)(dhcp_offer_lease_time % 3600)/60,
+                taken / 1000, (taken % 1000) / 10, how);
+        dhcp_set_boot_variables();
+    }
+    dhcp_enter_state(DHCP_BOUND);
+}
+
 static void dhcp_pump(packet_sink_t *s, packet_t *packet)
 {
     switch(dhcp_state){
@@ -302,47 +486,47 @@ static void dhcp_pump(packet_sink_t *s, packet_t *packet)
         case DHCP_SELECT:
             if(process_dhcp_reply(packet, dhcp_type_offer)){
                 // skip unsuitable offers
-                if(!dhcp_offer_ipv4_address || !dhcp_offer_gateway ||
-                        !dhcp_offer_dns_server || dhcp_offer_lease_time < 180)
+                if(!dhcp_lease_suitable())
                     break;
                 // at this point we're happy with the offer, let's go!
-                dhcp_send_request();
+                dhcp_send_request(dhcp_offer_ipv4_address, dhcp_server_id);
                 select_wait_time = short_wait_time;
                 dhcp_enter_state(DHCP_REQUEST);
+            }else if(process_dhcp_reply(packet, dhcp_type_ack) && dhcp_rapid_commit &&
+                    dhcp_lease_suitable()){
+                // the server committed to this lease without a REQUEST
+                select_wait_time = short_wait_time;
+                dhcp_bind(packet);
             }
             break;
+        case DHCP_REBOOT:
         case DHCP_REQUEST:
         case DHCP_RENEW:
             if(process_dhcp_reply(packet, dhcp_type_nack)){
+                if(dhcp_state == DHCP_REBOOT)
+                    dhcp_save_lease(0); // not ours any more
                 dhcp_enter_state(DHCP_DISCOVER); // start over again on any NACK
             }else if(process_dhcp_reply(packet, dhcp_type_ack)){
-                int prefixlen = 0;
-                uint32_t mask;
-                interface_ipv4_address = dhcp_offer_ipv4_address;
-                interface_subnet_mask = mask = dhcp_offer_subnet_mask;
-                interface_ipv4_gateway = dhcp_offer_gateway;
-                interface_dns_server = dhcp_offer_dns_server;
-                while(mask){
-                    prefixlen++;
-                    mask <<= 1;
-                }
-                if(dhcp_state == DHCP_REQUEST){ // don't print this on every RENEW
-                    printf("DHCP lease acquired (%d.%d.%d.%d/%d, %dh %dm)\n",
-                            (int)(interface_ipv4_address >> 24 & 0xff),
-                            (int)(interface_ipv4_address >> 16 & 0xff),
-                            (int)(interface_ipv4_address >>  8 & 0xff),
-                            (int)(interface_ipv4_address       & 0xff),
-                            prefixlen,
-                            (int)(dhcp_offer_lease_time / 3600),
-                            (int)(dhcp_offer_lease_time % 3600)/60);
-                }
-                dhcp_enter_state(DHCP_BOUND);
+                if(dhcp_state == DHCP_REBOOT && !dhcp_lease_suitable())
+                    dhcp_enter_state(DHCP_DISCOVER); // our old address, but not a lease we can use
+                else
+                    dhcp_bind(packet);
             }
             break;
     }
     packet_free(packet);
 }
 
+bool dhcp_running(void)
+{
+    return sink != NULL;
+}
+
+bool dhcp_bound(void)
+{
+    return sink && (dhcp_state == DHCP_BOUND || dhcp_state == DHCP_RENEW);
+}
+
 void dhcp_init(void)
 {
     sink = packet_sink_alloc();
@@ -352,5 +536,8 @@ void dhcp_init(void)
     sink->cb_packet_received = dhcp_pump;     // called when packets received
     sink->cb_timer_expired = dhcp_timer; // called on timer expiry
     net_add_packet_sink(sink);
-    dhcp_enter_state(DHCP_DISCOVER);
+
+    dhcp_start_time = gogoboot_read_timer();
+    dhcp_reboot_address = dhcp_load_lease();
+    dhcp_enter_state(dhcp_reboot_address ? DHCP_REBOOT : DHCP_DISCOVER);
 }
@@ -5,9 +5,11 @@
 
 static const int short_wait_time = 5; // seconds
 
-typedef enum { // start in DHCP_INIT
+typedef enum { // start in DHCP_REBOOT if we have a saved lease, otherwise DHCP_DISCOVER
+    DHCP_REBOOT,   // INIT-REBOOT: REQUEST our previous address; on ACK go to BOUND, on NACK or timeout go to init
     DHCP_DISCOVER, // create and send a DISCOVER message, start timer, go to SELECTING
-    DHCP_SELECT,   // wait for timer, pick best offer, send REQUEST, go to REQUESTING, if no offers go to INIT
+    DHCP_SELECT,   // wait for timer, pick best offer, send REQUEST, go to REQUESTING, if no offers go to INIT;
+                   // a Rapid Commit ACK goes straight to BOUND
     DHCP_REQUEST,  // receive ACK, start timer, go to BOUND; on NACK or timeout go to init
     DHCP_BOUND,    // wait for timer, go to RENEWING
     DHCP_RENEW,    // periodically send REQUESTs; transitions as per REQUESTING
@@ -44,6 +46,9 @@ static const uint8_t dhcp_opt_message_type  = 0x35;
 static const uint8_t dhcp_opt_server_id     = 0x36;
 static const uint8_t dhcp_opt_param_request = 0x37;
 static const uint8_t dhcp_opt_max_size      = 0x39;
+static const uint8_t dhcp_opt_tftp_server   = 0x42;
+static const uint8_t dhcp_opt_bootfile      = 0x43;
+static const uint8_t dhcp_opt_rapid_commit  = 0x50;
 static const uint8_t dhcp_opt_terminator    = 0xff;
 
 static const uint8_t dhcp_type_discover = 1;
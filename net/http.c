@@ -0,0 +1,340 @@
+/* (c) 2023 William R Sowerbutts <will@sowerbutts.com> */
+
+#include <types.h>
+#include <stdlib.h>
+#include <uart.h>
+#include <timers.h>
+#include <fatfs/ff.h>
+#include <cli.h>
+#include <init.h>
+#include <net.h>
+
+// documentation:
+// https://www.rfc-editor.org/rfc/rfc9112 - HTTP/1.1
+
+// A minimal HTTP/1.1 GET client over tcp.c. Servers are given by IPv4
+// address (we have no DNS resolver); we ask for "Connection: close" and
+// do not support chunked transfer encoding, which is plenty for a simple
+// file server such as "python3 -m http.server".
+
+#define HTTP_PORT        80
+#define HEADER_MAX     1024  // longest response header we will accept
+
+typedef struct http_transfer_t http_transfer_t;
+
+struct http_transfer_t {
+    FIL disk_file;
+    bool to_disk;
+    uint8_t *mem_buffer;          // when set, data is received to memory rather than disk_file
+    uint32_t mem_length;          // size of mem_buffer
+    char header[HEADER_MAX+1];
+    int header_length;
+    bool header_done;
+    int status;
+    int content_length;           // -1 when not given
+    int bytes_transferred;
+    bool failed;
+};
+
+static char *find_string(char *s, const char *needle)
+{
+    int n = strlen(needle);
+
+    for(; *s; s++)
+        if(strncmp(s, needle, n) == 0)
+            return s;
+
+    return NULL;
+}
+
+// parse "http://1.2.3.4[:port]/path"; returns NULL on error
+static const char *http_parse_url(const char *url, uint32_t *ip, uint16_t *port, char *host, int host_size)
+{
+    const char *p, *path;
+    int n;
+
+    if(strncasecmp(url, "http://", 7) == 0)
+        url += 7;
+
+    path = strchr(url, '/');
+    if(!path)
+        path = url + strlen(url);
+    n = path - url;
+    if(n == 0 || n >= host_size)
+        return NULL;
+    memcpy(host, url, n);
+    host[n] = 0;
+
+    *port = HTTP_PORT;
+    p = strchr(host, ':');
+    if(p){
+        *port = strtoul(p+1, NULL, 10);
+        host[p - host] = 0;
+    }
+
+    *ip = net_parse_ipv4(host);
+    if(!*ip || !*port)
+        return NULL;
+    if(p)
+        host[p - host] = ':'; // the Host: header includes the port
+
+    return *path ? path : "/";
+}
+
+static bool http_body_data(http_transfer_t *http, const uint8_t *data, int length)
+{
+    FRESULT fr;
+    unsigned int written;
+
+    if(length <= 0)
+        return true;
+
+    if(http->to_disk){
+        fr = f_write(&http->disk_file, data, length, &written);
+        if(fr != FR_OK || written != length){
+            printf("http: write failed: %s\n", f_errmsg(fr));
+            return false;
+        }
+    }else{
+        if(http->bytes_transferred + length > http->mem_length){
+            printf("http: data exceeds available memory\n");
+            return false;
+        }
+        memcpy(http->mem_buffer + http->bytes_transferred, data, length);
+    }
+
+    http->bytes_transferred += length;
+    return true;
+}
+
+static bool http_parse_header(http_transfer_t *http)
+{
+    char *line, *next, *value;
+
+    line = http->header;
+    if(strncmp(line, "HTTP/1.", 7) != 0 || !(value = strchr(line, ' '))){
+        printf("http: bad response\n");
+        return false;
+    }
+    http->status = strtoul(value + 1, NULL, 10);
+
+    for(; line; line = next){
+        next = find_string(line, "\r\n");
+        if(next){
+            *next = 0;
+            next += 2;
+        }
+        if(line == http->header){
+            printf("http: %s\n", line); // status line
+            continue;
+        }
+        value = strchr(line, ':');
+        if(!value)
+            continue;
+        *value++ = 0;
+        while(*value == ' ')
+            value++;
+        if(strcasecmp(line, "Content-Length") == 0)
+            http->content_length = strtoul(value, NULL, 10);
+        else if(strcasecmp(line, "Transfer-Encoding") == 0 && strcasecmp(value, "identity") != 0){
+            printf("http: unsupported transfer encoding \"%s\"\n", value);
+            return false;
+        }
+    }
+
+    if(http->status != 200)
+        return false;
+
+    return true;
+}
+
+static bool http_receive(void *cb_private, const uint8_t *data, int length)
+{
+    http_transfer_t *http = cb_private;
+    char *end;
+    int n, used;
+
+    if(http->failed)
+        return false;
+
+    if(!http->header_done){
+        // collect the response header, which may span several segments
+        n = HEADER_MAX - http->header_length;
+        if(n > length)
+            n = length;
+        memcpy(http->header + http->header_length, data, n);
+        http->header[http->header_length + n] = 0;
+
+        end = find_string(http->header, "\r\n\r\n");
+        if(!end){
+            http->header_length += n;
+            if(http->header_length == HEADER_MAX){
+                printf("http: response header too long\n");
+                http->failed = true;
+                return false;
+            }
+            return true;
+        }
+
+        // whatever follows the header in this segment is body
+        used = end + 4 - http->header - http->header_length;
+        *(end + 2) = 0;
+        http->header_done = true;
+        if(!http_parse_header(http)){
+            http->failed = true;
+            return false;
+        }
+        data += used;
+        length -= used;
+    }
+
+    if(!http_body_data(http, data, length)){
+        http->failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+static bool http_run(http_transfer_t *http, const char *url)
+{
+    uint32_t ip, start, taken, rate;
+    uint16_t port;
+    char host[64], *request;
+    const char *path;
+    int uart_byte, reported_transferred, sent, length;
+    bool success, closing = false;
+    timer_t close_timeout = 0;
+
+    path = http_parse_url(url, &ip, &port, host, sizeof(host));
+    if(!path){
+        printf("http: cannot parse URL \"%s\" (expected http://1.2.3.4[:port]/path)\n", url);
+        return false;
+    }
+
+    request = malloc(strlen(path) + strlen(host) + 64);
+    strcpy(request, "GET ");
+    strcat(request, path);
+    strcat(request, " HTTP/1.1\r\nHost: ");
+    strcat(request, host);
+    strcat(request, "\r\nConnection: close\r\n\r\n");
+    length = strlen(request);
+    sent = 0;
+
+    http->content_length = -1;
+
+    if(!tcp_connect(ip, port, http_receive, http)){
+        free(request);
+        return false;
+    }
+
+    start = gogoboot_read_timer();
+    printf("Transfer started: Press Q to abort\n");
+
+    reported_transferred = 0;
+    while(tcp_state() != tcp_closed){
+        net_pump();
+        if(sent < length && tcp_state() == tcp_established){
+            int n = tcp_send(request + sent, length - sent);
+            if(n > 0)
+                sent += n;
+        }
+        // close our end once the server has, or once everything has arrived
+        if(!closing && (tcp_peer_closed() || http->failed ||
+                    (http->content_length >= 0 && http->bytes_transferred >= http->content_length))){
+            tcp_close();
+            closing = true;
+            close_timeout = set_timer_sec(2);
+        }
+        if(closing && timer_expired(close_timeout))
+            tcp_abort(); // server never finished closing; we have what we need
+        uart_byte = uart_read_byte();
+        if(uart_byte == 'q' || uart_byte == 'Q'){
+            printf("Aborted.\n");
+            tcp_abort();
+            http->failed = true;
+            break;
+        }
+        if((http->bytes_transferred - reported_transferred) >= (256*1024)){
+            reported_transferred = http->bytes_transferred;
+            if(http->content_length > 0)
+                printf("http: %d/%d KB\n", reported_transferred >> 10, http->content_length >> 10);
+            else
+                printf("http: %d KB\n", reported_transferred >> 10);
+        }
+    }
+
+    free(request);
+
+    if(!http->header_done && tcp_was_reset())
+        printf("http: connection failed\n");
+
+    success = !http->failed && http->header_done && http->status == 200 &&
+              (http->content_length >= 0 ? http->bytes_transferred == http->content_length
+                                         : !tcp_was_reset());
+
+    if(success){
+        printf("Transfer success.\n");
+        taken = gogoboot_read_timer() - start;
+        taken /= (TIMER_HZ/10); // taken is now in 10ths of a second
+        if(taken == 0)
+            taken = 1; // avoid div 0
+        rate = ((http->bytes_transferred / taken)*8) / 1000;
+        printf("Transferred %d bytes in %ld.%lds (%ld.%02ld Mbit/sec)\n",
+                http->bytes_transferred, taken/10, taken%10, rate/100, rate%100);
+    }else{
+        printf("Transfer FAILED!\n");
+    }
+
+    return success;
+}
+
+bool http_get(const char *url, const char *disk_filename)
+{
+    FRESULT fr;
+    bool success;
+    http_transfer_t *http = malloc(sizeof(http_transfer_t));
+
+    memset(http, 0, sizeof(http_transfer_t));
+    http->to_disk = true;
+
+    fr = f_open(&http->disk_file, disk_filename, FA_WRITE | FA_CREATE_ALWAYS);
+    if(fr != FR_OK){
+        printf("http: failed to open \"%s\": %s\n", disk_filename, f_errmsg(fr));
+        free(http);
+        return false;
+    }
+
+    printf("http: get %s to local file \"%s\"\n", url, disk_filename);
+    success = http_run(http, url);
+    f_close(&http->disk_file);
+    free(http);
+
+    return success;
+}
+
+bool http_get_memory(const char *url, uint32_t address, uint32_t length)
+{
+    bool success;
+    const char *range_err;
+    http_transfer_t *http;
+
+    range_err = check_writable_range(address, length, false);
+    if(range_err){
+        printf("http: address range error: %s\n", range_err);
+        return false;
+    }
+
+    http = malloc(sizeof(http_transfer_t));
+    memset(http, 0, sizeof(http_transfer_t));
+    http->mem_buffer = (uint8_t*)address;
+    http->mem_length = length;
+
+    printf("http: get %s to memory at 0x%lx\n", url, address);
+    success = http_run(http, url);
+    if(success)
+        printf("Loaded %d bytes at 0x%lx\n", http->bytes_transferred, address);
+    free(http);
+
+    return success;
+}
@@ -16,15 +16,17 @@ static void icmp_send_unreachable(packet_sink_t *sink, packet_t *packet)
         icmp_throttle_timer = set_timer_ms(100);
 
         packet_t *unreach = packet_create_icmp(ntohl(packet->ipv4->source_ip), sizeof(ipv4_header_t) + 8);
-        packet_set_destination_mac(unreach, &packet->eth->source_mac);
+        if(unreach){
+            packet_set_destination_mac(unreach, &packet->eth->source_mac);
 
-        // fill in ICMP message
-        unreach->icmp->type = 3; // Destination Unreachable
-        unreach->icmp->code = 3; // Port Unreachable
-        memcpy(unreach->icmp->payload, packet->ipv4, sizeof(ipv4_header_t) + 8);
+            // fill in ICMP message
+            unreach->icmp->type = 3; // Destination Unreachable
+            unreach->icmp->code = 3; // Port Unreachable
+            memcpy(unreach->icmp->payload, packet->ipv4, sizeof(ipv4_header_t) + 8);
 
-        // transmit
-        net_tx(unreach);
+            // transmit
+            net_tx(unreach);
+        }
     }
 
     // in all cases we have to free the incoming packet
@@ -34,6 +36,8 @@ static void icmp_send_unreachable(packet_sink_t *sink, packet_t *packet)
 static void icmp_received(packet_sink_t *sink, packet_t *packet)
 {
     if(packet->icmp->type == 8){ // echo request
+        uint32_t old_destination_ip = packet->ipv4->destination_ip;
+
         // convert echo request to echo reply (per RFC792!)
         packet->icmp->type = 0; // echo reply
 
@@ -48,6 +52,14 @@ static void icmp_received(packet_sink_t *sink, packet_t *packet)
         packet->ipv4->source_ip = ntohl(interface_ipv4_address);
         memcpy(packet->eth->source_mac, interface_macaddr, sizeof(macaddr_t));
 
+        // patch the checksums rather than summing the whole echo again (RFC 1624).
+        // the swap leaves the IPv4 sum alone; only the address we replaced matters.
+        packet->icmp->checksum = net_checksum_adjust(packet->icmp->checksum,
+                (8 << 8) | packet->icmp->code, (0 << 8) | packet->icmp->code);
+        packet->ipv4->checksum = net_checksum_adjust32(packet->ipv4->checksum,
+                old_destination_ip, packet->ipv4->source_ip);
+        packet->flags |= packet_flag_checksums_valid;
+
         net_tx(packet);
         // do NOT free received packet since it is now being re-used for transmission
     }else{
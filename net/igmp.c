@@ -0,0 +1,192 @@
+/* (c) 2023 William R Sowerbutts <will@sowerbutts.com> */
+
+#include <types.h>
+#include <stdlib.h>
+#include <timers.h>
+#include <net.h>
+
+// documentation:
+// https://www.rfc-editor.org/rfc/rfc1112 - Host Extensions for IP Multicasting
+// https://www.rfc-editor.org/rfc/rfc2236 - Internet Group Management Protocol, Version 2
+
+// Just enough IGMPv2 host support to receive multicast TFTP: we report our
+// groups when we join them and when a router or snooping switch asks, so
+// the group traffic keeps flowing to our port, and say goodbye on leaving.
+
+#define MAX_GROUPS        4
+#define REPEAT_REPORT  1000 // ms; unsolicited reports are sent twice in case one is lost
+
+static const uint32_t all_hosts_group = 0xe0000001;   // 224.0.0.1
+static const uint32_t all_routers_group = 0xe0000002; // 224.0.0.2
+
+typedef struct multicast_group_t multicast_group_t;
+
+struct multicast_group_t {
+    uint32_t group;         // 0 when the slot is free
+    int users;              // net_multicast_join() calls not yet matched by net_multicast_leave()
+    bool report_pending;
+    timer_t report_time;    // when to send the pending report
+};
+
+static multicast_group_t groups[MAX_GROUPS];
+static packet_sink_t *igmp_sink;
+
+void net_multicast_macaddr(uint32_t group, macaddr_t *mac)
+{
+    // 01:00:5e followed by the low 23 bits of the group (RFC 1112 section 6.4)
+    (*mac)[0] = 0x01;
+    (*mac)[1] = 0x00;
+    (*mac)[2] = 0x5e;
+    (*mac)[3] = (group >> 16) & 0x7f;
+    (*mac)[4] = (group >> 8) & 0xff;
+    (*mac)[5] = group & 0xff;
+}
+
+static void igmp_update_filter(void)
+{
+    macaddr_t list[MAX_GROUPS+1];
+    int count = 0;
+
+    for(int i=0; i<MAX_GROUPS; i++)
+        if(groups[i].group)
+            net_multicast_macaddr(groups[i].group, &list[count++]);
+
+    // queries go to all-hosts, which we only need to hear while in a group
+    if(count)
+        net_multicast_macaddr(all_hosts_group, &list[count++]);
+
+    eth_set_multicast_list(list, count);
+}
+
+static void igmp_send(uint8_t type, uint32_t destination, uint32_t group)
+{
+    packet_t *packet = packet_create_igmp(destination);
+
+    if(!packet)
+        return;
+
+    packet->igmp->type = type;
+    packet->igmp->max_response_time = 0;
+    packet->igmp->group = htonl(group);
+    net_tx(packet);
+}
+
+static void igmp_schedule(void)
+{
+    igmp_sink->timer = 0;
+    for(int i=0; i<MAX_GROUPS; i++)
+        if(groups[i].group && groups[i].report_pending &&
+           (!igmp_sink->timer || ((groups[i].report_time - igmp_sink->timer) & 0x80000000)))
+            igmp_sink->timer = groups[i].report_time;
+}
+
+static void igmp_timer_expired(packet_sink_t *sink)
+{
+    for(int i=0; i<MAX_GROUPS; i++){
+        if(groups[i].group && groups[i].report_pending && timer_expired(groups[i].report_time)){
+            groups[i].report_pending = false;
+            igmp_send(igmp_type_v2_report, groups[i].group, groups[i].group);
+        }
+    }
+    igmp_schedule();
+}
+
+static void igmp_received(packet_sink_t *sink, packet_t *packet)
+{
+    uint32_t group;
+    int max_ms;
+    timer_t when;
+
+    if(!packet->igmp){
+        packet_free(packet);
+        return;
+    }
+
+    group = ntohl(packet->igmp->group);
+
+    switch(packet->igmp->type){
+        case igmp_type_query:
+            // IGMPv1 queries leave the response time as 0, meaning 10 seconds
+            max_ms = packet->igmp->max_response_time ? packet->igmp->max_response_time * 100 : 10000;
+            for(int i=0; i<MAX_GROUPS; i++){
+                if(!groups[i].group || (group && group != groups[i].group))
+                    continue;
+                // answer at a random point in the interval so hosts don't all reply at once
+                when = set_timer_ms((gogoboot_read_timer() * 7 + i * 1013) % max_ms);
+                if(!groups[i].report_pending || ((when - groups[i].report_time) & 0x80000000)){
+                    groups[i].report_pending = true;
+                    groups[i].report_time = when;
+                }
+            }
+            igmp_schedule();
+            break;
+        case igmp_type_v1_report:
+        case igmp_type_v2_report:
+            // another member has answered for this group; no need for us to
+            for(int i=0; i<MAX_GROUPS; i++)
+                if(groups[i].group == group)
+                    groups[i].report_pending = false;
+            igmp_schedule();
+            break;
+        default:
+            break;
+    }
+
+    packet_free(packet);
+}
+
+bool net_multicast_join(uint32_t group)
+{
+    multicast_group_t *g = NULL;
+
+    for(int i=0; i<MAX_GROUPS; i++){
+        if(groups[i].group == group){
+            groups[i].users++;
+            return true;
+        }
+        if(!g && !groups[i].group)
+            g = &groups[i];
+    }
+
+    if(!g){
+        printf("igmp: cannot join more than %d groups\n", MAX_GROUPS);
+        return false;
+    }
+
+    g->group = group;
+    g->users = 1;
+    igmp_update_filter();
+
+    igmp_send(igmp_type_v2_report, group, group);
+    g->report_pending = true;
+    g->report_time = set_timer_ms(REPEAT_REPORT);
+    igmp_schedule();
+
+    return true;
+}
+
+void net_multicast_leave(uint32_t group)
+{
+    for(int i=0; i<MAX_GROUPS; i++){
+        if(groups[i].group == group){
+            if(--groups[i].users > 0)
+                return;
+            igmp_send(igmp_type_leave, all_routers_group, group);
+            groups[i].group = 0;
+            groups[i].report_pending = false;
+            igmp_update_filter();
+            igmp_schedule();
+            return;
+        }
+    }
+}
+
+void net_igmp_init(void)
+{
+    igmp_sink = packet_sink_alloc();
+    igmp_sink->match_ethertype = ethertype_ipv4;
+    igmp_sink->match_ipv4_protocol = ip_proto_igmp;
+    igmp_sink->cb_packet_received = igmp_received;
+    igmp_sink->cb_timer_expired = igmp_timer_expired;
+    net_add_packet_sink(igmp_sink);
+}
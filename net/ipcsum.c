@@ -6,20 +6,10 @@
 #include <cli.h>
 #include <net.h>
 
-static uint32_t checksum_update(uint32_t sum, uint16_t *addr, unsigned int count)
+// the summing is done 32 bits at a time by ip_checksum_add() in cksum.s
+static inline uint32_t checksum_update(uint32_t sum, uint16_t *addr, unsigned int count)
 {
-    // sum words
-    while(count >= 2){
-        sum += *(addr++);
-        count-=2;
-    }
-
-    //if any bytes left, pad the bytes and add
-    if(count > 0) {
-        sum += ((*addr)&htons(0xFF00));
-    }
-
-    return sum;
+    return ip_checksum_add(sum, addr, count);
 }
 
 static uint16_t checksum_complete(uint32_t sum)
@@ -46,7 +36,8 @@ void net_compute_ipv4_checksum(packet_t *packet)
 
 bool net_verify_ipv4_checksum(packet_t *packet)
 {
-    return (checksum_compute((uint16_t*)packet->ipv4, sizeof(ipv4_header_t)) == 0);
+    // received headers may carry options (eg IGMP's router alert)
+    return (checksum_compute((uint16_t*)packet->ipv4, (packet->ipv4->version_length & 0x0f) << 2) == 0);
 }
 
 void net_compute_icmp_checksum(packet_t *packet)
@@ -61,21 +52,90 @@ bool net_verify_icmp_checksum(packet_t *packet)
     return (checksum_compute((uint16_t*)packet->icmp, ntohs(packet->ipv4->length) - sizeof(ipv4_header_t)) == 0);
 }
 
+void net_compute_igmp_checksum(packet_t *packet)
+{
+    packet->igmp->checksum = 0;
+    packet->igmp->checksum = htons(checksum_compute((uint16_t*)packet->igmp, sizeof(igmp_header_t)));
+}
+
+bool net_verify_igmp_checksum(packet_t *packet)
+{
+    return (checksum_compute((uint16_t*)packet->igmp, sizeof(igmp_header_t)) == 0);
+}
+
+// the "pseudo-header" of UDP and TCP checksums; length is in network byte order
+static uint32_t pseudoheader_sum(packet_t *packet, uint16_t length)
+{
+    uint32_t sum;
+    sum = packet->ipv4->protocol;
+    sum += length;
+    return checksum_update(sum, (uint16_t*)&packet->ipv4->source_ip, sizeof(uint32_t)*2);
+}
+
 static uint16_t udp_checksum_pseudoheader(packet_t *packet)
 {
     uint32_t sum;
     // we have to sum a "pseudo-header"
-    sum = checksum_update(0, (uint16_t*)&packet->ipv4->source_ip, sizeof(uint32_t)*2);
-    sum += packet->ipv4->protocol;
-    sum += packet->udp->length; // yes, this field is summed twice!
+    sum = pseudoheader_sum(packet, packet->udp->length); // yes, this field is summed twice!
                                 // ... then the real udp header + data
-    sum = checksum_update(sum, (uint16_t*)packet->udp, ntohs(packet->udp->length));
+    if(packet->steered_data){
+        // data was split by net_eth_steer at an even offset
+        sum = checksum_update(sum, (uint16_t*)packet->udp, sizeof(udp_header_t) + NET_STEER_PEEK);
+        sum = checksum_update(sum, (uint16_t*)packet->steered_data, packet->data_length - NET_STEER_PEEK);
+    }else
+        sum = checksum_update(sum, (uint16_t*)packet->udp, ntohs(packet->udp->length));
     return htons(checksum_complete(sum));
 }
 
+// sum of frame bytes [start, end) each in the byte lane it occupies in a
+// 16-bit word, as they were when the driver summed the frame
+static uint32_t frame_bytes_sum(packet_t *packet, int start, int end)
+{
+    uint32_t sum = 0;
+
+    for(int i=start; i<end; i++)
+        sum += (i & 1) ? packet->buffer[i] : (packet->buffer[i] << 8);
+
+    return sum;
+}
+
+// fast path using the sum of the whole frame from the driver. the IPv4
+// header has already been verified, and a valid header sums to -0, so once
+// we take away the ethernet header and anything following the IPv4 packet
+// (padding, CRC) we are left with the UDP or TCP header and data.
+static bool rx_sum_usable(packet_t *packet)
+{
+    return (packet->flags & packet_flag_rx_sum_valid) && packet->ipv4->version_length == 0x45 &&
+           sizeof(ethernet_header_t) + ntohs(packet->ipv4->length) <= packet->buffer_length;
+}
+
+static bool verify_from_rx_sum(packet_t *packet, uint16_t length)
+{
+    uint32_t sum, outside;
+    int ip_end = sizeof(ethernet_header_t) + ntohs(packet->ipv4->length);
+
+    outside = frame_bytes_sum(packet, 0, sizeof(ethernet_header_t)) +
+              frame_bytes_sum(packet, ip_end, packet->buffer_length);
+
+    // small terms first; checksum_update() deals with carries beyond 32 bits
+    sum = packet->rx_sum;
+    sum += checksum_complete(outside); // one's complement subtraction
+    sum += packet->ipv4->protocol;
+    sum += length;
+    sum = checksum_update(sum, (uint16_t*)&packet->ipv4->source_ip, sizeof(uint32_t)*2);
+
+    return checksum_complete(sum) == 0;
+}
+
 bool net_verify_udp_checksum(packet_t *packet)
 {
-    return (packet->udp->checksum == 0 || udp_checksum_pseudoheader(packet) == 0);
+    if(packet->udp->checksum == 0)
+        return true;
+
+    if(rx_sum_usable(packet))
+        return verify_from_rx_sum(packet, packet->udp->length);
+
+    return udp_checksum_pseudoheader(packet) == 0;
 }
 
 void net_compute_udp_checksum(packet_t *packet)
@@ -88,14 +148,40 @@ void net_compute_udp_checksum(packet_t *packet)
     packet->udp->checksum = htons(cs);
 }
 
+// RFC 1624 incremental update, for when one 16-bit word covered by a
+// checksum changes from old_word to new_word: HC' = ~(~HC + ~m + m')
+uint16_t net_checksum_adjust(uint16_t checksum, uint16_t old_word, uint16_t new_word)
+{
+    return checksum_complete((uint16_t)~checksum + (uint16_t)~old_word + new_word);
+}
+
+uint16_t net_checksum_adjust32(uint16_t checksum, uint32_t old_long, uint32_t new_long)
+{
+    checksum = net_checksum_adjust(checksum, old_long >> 16, new_long >> 16);
+    return net_checksum_adjust(checksum, old_long & 0xffff, new_long & 0xffff);
+}
+
+static uint16_t tcp_checksum_pseudoheader(packet_t *packet)
+{
+    uint16_t length = ntohs(packet->ipv4->length) - sizeof(ipv4_header_t);
+    uint32_t sum;
+
+    sum = pseudoheader_sum(packet, htons(length));
+    sum = checksum_update(sum, (uint16_t*)packet->tcp, length);
+    return htons(checksum_complete(sum));
+}
+
 bool net_verify_tcp_checksum(packet_t *packet)
 {
-    // printf("write net_verify_tcp_checksum!\n");
-    return true;
+    if(rx_sum_usable(packet))
+        return verify_from_rx_sum(packet, htons(ntohs(packet->ipv4->length) - sizeof(ipv4_header_t)));
+
+    return tcp_checksum_pseudoheader(packet) == 0;
 }
 
 void net_compute_tcp_checksum(packet_t *packet)
 {
-    printf("write net_compute_tcp_checksum!\n");
+    packet->tcp->checksum = 0;
+    packet->tcp->checksum = htons(tcp_checksum_pseudoheader(packet));
 }
 
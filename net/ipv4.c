@@ -9,6 +9,8 @@
 static packet_t *packet_create_ipv4(uint32_t dest_ipv4, int data_size, int proto)
 {
     packet_t *p = packet_alloc(sizeof(ethernet_header_t) + sizeof(ipv4_header_t) + data_size);
+    if(!p)
+        return NULL;
 
     // set up ethernet header
     memcpy(&p->eth->source_mac, interface_macaddr, sizeof(macaddr_t));
@@ -32,25 +34,40 @@ static packet_t *packet_create_ipv4(uint32_t dest_ipv4, int data_size, int proto
 packet_t *packet_create_icmp(uint32_t dest_ipv4, int data_size)
 {
     packet_t *p = packet_create_ipv4(dest_ipv4, data_size + sizeof(icmp_header_t), ip_proto_icmp);
+    if(!p)
+        return NULL;
     p->icmp = (icmp_header_t*)p->ipv4->payload;
     p->data = (uint8_t*)p->icmp->payload;
     p->data_length = data_size;
     return p;
 }
 
-packet_t *packet_create_tcp(uint32_t dest_ipv4, uint16_t destination_port, uint16_t source_port, int data_size)
+packet_t *packet_create_igmp(uint32_t dest_ipv4)
 {
-    packet_t *p = packet_create_ipv4(dest_ipv4, data_size + sizeof(tcp_header_t), ip_proto_udp);
-    p->tcp = (tcp_header_t*)p->ipv4->payload;
-    p->data = (uint8_t*)p->tcp->options; // + options_size
-    p->data_length = data_size;          // - options_size
+    packet_t *p = packet_create_ipv4(dest_ipv4, sizeof(igmp_header_t), ip_proto_igmp);
+    if(!p)
+        return NULL;
+    p->ipv4->ttl = 1; // never leaves the local network (RFC 2236)
+    p->igmp = (igmp_header_t*)p->ipv4->payload;
+    return p;
+}
 
-    printf("packet_create_tcp is incomplete!\n");
+packet_t *packet_create_tcp(uint32_t dest_ipv4, uint16_t destination_port, uint16_t source_port, int data_size)
+{
+    packet_t *p = packet_create_ipv4(dest_ipv4, data_size + sizeof(tcp_header_t), ip_proto_tcp);
+    if(!p)
+        return NULL;
 
-    // set up tcp header
-    // p->tcp->... = ...;
+    // set up tcp header; no options (caller may move data to make room)
+    p->tcp = (tcp_header_t*)p->ipv4->payload;
+    p->data = (uint8_t*)p->tcp->options;
+    p->data_length = data_size;
 
-    // p->data needs to be computed depending on tcp option headers present.
+    p->tcp->source_port = htons(source_port);
+    p->tcp->destination_port = htons(destination_port);
+    p->tcp->data_offset = (sizeof(tcp_header_t) / 4) << 4;
+    p->tcp->flags = 0;
+    p->tcp->urgent_pointer = 0;
 
     return p;
 }
@@ -58,6 +75,8 @@ packet_t *packet_create_tcp(uint32_t dest_ipv4, uint16_t destination_port, uint1
 packet_t *packet_create_udp(uint32_t dest_ipv4, uint16_t destination_port, uint16_t source_port, int data_size)
 {
     packet_t *p = packet_create_ipv4(dest_ipv4, data_size + sizeof(udp_header_t), ip_proto_udp);
+    if(!p)
+        return NULL;
 
     // set up udp header
     p->udp = (udp_header_t*)p->ipv4->payload;
@@ -94,6 +113,17 @@ bool packet_data_resize(packet_t *packet, int new_data_length)
             len += sizeof(udp_header_t);
             packet->udp->length = htons(len);
             break;
+        case ip_proto_tcp:
+            header_length = packet->data - packet->buffer;
+
+            /* check it will fit */
+            if(header_length + new_data_length > packet->buffer_length_alloc)
+                return false;
+
+            /* TCP has no length field of its own */
+            packet->data_length = new_data_length;
+            len = (packet->data - (uint8_t*)packet->tcp) + new_data_length;
+            break;
         default:
             /* patches welcome! :) */
             return false;
@@ -136,3 +166,195 @@ uint32_t net_parse_ipv4(const char *input)
 
     return result;
 }
+
+char *net_format_ipv4(char *buffer, uint32_t address)
+{
+    char *p = buffer;
+    int octet;
+
+    for(int shift=24; shift>=0; shift-=8){
+        octet = (address >> shift) & 0xff;
+        if(octet >= 100)
+            *p++ = '0' + octet / 100;
+        if(octet >= 10)
+            *p++ = '0' + (octet / 10) % 10;
+        *p++ = '0' + octet % 10;
+        *p++ = shift ? '.' : 0;
+    }
+
+    return buffer;
+}
+
+/* --- fragment reassembly --- */
+
+// Only UDP is reassembled: it lets TFTP use blocks larger than one frame.
+// The first fragment's packet_t carries the headers and is delivered with
+// packet->udp pointing at a reassembly buffer, which packet_free() returns.
+// A few packets from the pool are held while datagrams are incomplete, so
+// incomplete datagrams are given up on quickly.
+
+#define REASSEMBLY_SLOTS       4
+#define REASSEMBLY_TIMEOUT  1000  // ms
+#define REASSEMBLY_UNITS    (IPV4_REASSEMBLY_MAX / 8)
+
+typedef struct ipv4_reassembly_t ipv4_reassembly_t;
+
+struct ipv4_reassembly_t {
+    bool collecting;            // fragments arriving
+    bool delivered;             // buffer belongs to a packet until it is freed
+    uint32_t source_ip;         // these three (and the protocol, always UDP) identify the datagram
+    uint32_t destination_ip;
+    uint16_t id;
+    packet_t *first;            // fragment at offset 0, once it arrives
+    int total_length;           // payload length, once the final fragment arrives; else -1
+    int units_received;         // 8-byte units of payload received
+    timer_t timeout;
+    uint8_t map[REASSEMBLY_UNITS / 8]; // units received
+    uint8_t *buffer;            // payload, IPV4_REASSEMBLY_MAX bytes
+};
+
+static ipv4_reassembly_t reassembly[REASSEMBLY_SLOTS];
+static int reassembly_collecting = 0;
+uint32_t ipv4_reassembly_failures = 0;
+
+void net_ipv4_reassembly_init(void)
+{
+    for(int i=0; i<REASSEMBLY_SLOTS; i++)
+        reassembly[i].buffer = malloc(IPV4_REASSEMBLY_MAX);
+}
+
+int net_ipv4_reassembly_max(void)
+{
+    return reassembly[0].buffer ? IPV4_REASSEMBLY_MAX : 0;
+}
+
+static void reassembly_abandon(ipv4_reassembly_t *r)
+{
+    if(r->first)
+        packet_free(r->first);
+    r->first = NULL;
+    r->collecting = false;
+    reassembly_collecting--;
+    ipv4_reassembly_failures++;
+}
+
+// called from net_pump
+void net_ipv4_reassembly_expire(void)
+{
+    if(!reassembly_collecting)
+        return;
+
+    for(int i=0; i<REASSEMBLY_SLOTS; i++)
+        if(reassembly[i].collecting && timer_expired(reassembly[i].timeout))
+            reassembly_abandon(&reassembly[i]);
+}
+
+// called from packet_free
+void net_ipv4_reassembly_release(packet_t *packet)
+{
+    for(int i=0; i<REASSEMBLY_SLOTS; i++)
+        if(reassembly[i].buffer == packet->reassembly_buffer)
+            reassembly[i].delivered = false;
+    packet->reassembly_buffer = NULL;
+}
+
+static ipv4_reassembly_t *reassembly_find(ipv4_header_t *ip)
+{
+    ipv4_reassembly_t *r, *unused = NULL;
+
+    for(int i=0; i<REASSEMBLY_SLOTS; i++){
+        r = &reassembly[i];
+        if(r->collecting){
+            if(r->id == ip->id && r->source_ip == ip->source_ip && r->destination_ip == ip->destination_ip)
+                return r;
+        }else if(!r->delivered && !unused)
+            unused = r;
+    }
+
+    if(unused){
+        r = unused;
+        r->collecting = true;
+        r->source_ip = ip->source_ip;
+        r->destination_ip = ip->destination_ip;
+        r->id = ip->id;
+        r->first = NULL;
+        r->total_length = -1;
+        r->units_received = 0;
+        r->timeout = set_timer_ms(REASSEMBLY_TIMEOUT);
+        memset(r->map, 0, sizeof(r->map));
+        reassembly_collecting++;
+    }
+
+    return unused;
+}
+
+// called by net_eth_push with a fragment whose IPv4 header checksum is good.
+// returns the reassembled datagram when this fragment completes one, or NULL
+// once the fragment has been kept or freed.
+packet_t *net_ipv4_reassemble(packet_t *packet)
+{
+    ipv4_header_t *ip = packet->ipv4;
+    ipv4_reassembly_t *r;
+    int header_length, offset, length, unit, end;
+    uint16_t frag;
+    bool more;
+
+    header_length = (ip->version_length & 0x0f) << 2;
+    frag = ntohs(ip->flags_and_frags);
+    offset = (frag & 0x1fff) << 3;
+    more = (frag & 0x2000) != 0;
+    length = ntohs(ip->length) - header_length;
+
+    if(ip->protocol != ip_proto_udp || !reassembly[0].buffer || length <= 0 ||
+       (more && (length & 7)) || offset + length > IPV4_REASSEMBLY_MAX ||
+       sizeof(ethernet_header_t) + header_length + length > packet->buffer_length){
+        ipv4_reassembly_failures++;
+        packet_free(packet);
+        return NULL;
+    }
+
+    r = reassembly_find(ip);
+    if(!r){ // every buffer is busy
+        ipv4_reassembly_failures++;
+        packet_free(packet);
+        return NULL;
+    }
+
+    end = (offset + length + 7) >> 3;
+    for(unit = offset >> 3; unit < end; unit++){
+        if(!(r->map[unit >> 3] & (1 << (unit & 7)))){
+            r->map[unit >> 3] |= 1 << (unit & 7);
+            r->units_received++;
+        }
+    }
+    memcpy(r->buffer + offset, (uint8_t*)ip + header_length, length);
+    if(!more)
+        r->total_length = offset + length;
+
+    if(offset == 0 && !r->first)
+        r->first = packet; // keep its headers
+    else
+        packet_free(packet);
+
+    if(!r->first || r->total_length < 0 || r->units_received != (r->total_length + 7) >> 3)
+        return NULL;
+
+    if(ntohs(((udp_header_t*)r->buffer)->length) > r->total_length){
+        reassembly_abandon(r);
+        return NULL;
+    }
+
+    // complete: present it as one datagram
+    packet = r->first;
+    r->first = NULL;
+    r->collecting = false;
+    r->delivered = true;
+    reassembly_collecting--;
+
+    packet->ipv4->length = htons(header_length + r->total_length);
+    packet->ipv4->flags_and_frags = 0;
+    packet->flags &= ~packet_flag_rx_sum_valid; // the driver only summed the first fragment
+    packet->reassembly_buffer = r->buffer;
+
+    return packet;
+}
@@ -32,6 +32,7 @@ static void push_packet_ready(int len);
     static inline uint8_t  read_port_byte(uint16_t port)             { return isa_read_byte(port); }
     static inline uint16_t read_port_word(uint16_t port)             { return isa_read_word(port); }
     static inline void     io_slow_down(void)                               { isa_slow_down(); }
+    static inline volatile void *data_port(uint16_t port)                   { return ISA_XLATE_ADDR_WORD(port); }
 #elif defined(TARGET_KISS) || defined(TARGET_MINI)
     /* 8-bit bus targets: KISS-68030 */
     #include <ecb/ecb.h>
@@ -41,6 +42,7 @@ static void push_packet_ready(int len);
     static inline void    write_port_byte(uint16_t port, uint8_t val)       { ecb_write_byte(port, val); }
     static inline uint8_t  read_port_byte(uint16_t port)             { return ecb_read_byte(port); }
     static inline void     io_slow_down(void)                               { ecb_slow_down(); }
+    static inline volatile void *data_port(uint16_t port)                   { return &ECB_DEVICE_IO[port]; }
 #else
     #pragma error update ne2000.c for your target
 #endif
@@ -104,9 +106,8 @@ static void dp83902a_start(macaddr_t enaddr)
     write_port_byte_pause(nic.base + DP_RBCL, 0);
     write_port_byte_pause(nic.base + DP_RCR, DP_RCR_MON);       /* Accept no packets */
     write_port_byte_pause(nic.base + DP_TCR, DP_TCR_LOCAL);     /* Transmitter [virtually] off */
-    write_port_byte_pause(nic.base + DP_TPSR, nic.tx_buf1);     /* Transmitter start page */
-    nic.tx1 = nic.tx2 = 0;
-    nic.tx_next = nic.tx_buf1;
+    write_port_byte_pause(nic.base + DP_TPSR, nic.tx_buf_start); /* Transmitter start page */
+    nic.tx_fill = nic.tx_xmit = nic.tx_count = 0;
     nic.tx_started = false;
 
     write_port_byte_pause(nic.base + DP_PSTART, nic.rx_buf_start); /* Receive ring start page */
@@ -120,10 +121,14 @@ static void dp83902a_start(macaddr_t enaddr)
     for (i = 0;  i < 6;  i++) {
         write_port_byte_pause(nic.base + DP_P1_PAR0+i, enaddr[i]);
     }
+    for (i = 0;  i < 8;  i++) {
+        write_port_byte_pause(nic.base + DP_P1_MAR0+i, nic.mar[i]);
+    }
     /* Enable and start device */
     write_port_byte_pause(nic.base + DP_CR, DP_CR_PAGE0 | DP_CR_NODMA | DP_CR_START);
     write_port_byte_pause(nic.base + DP_TCR, DP_TCR_NORMAL); /* Normal transmit operations */
-    write_port_byte_pause(nic.base + DP_RCR, DP_RCR_AB);  /* Accept broadcast, no errors, no multicast */
+    /* Accept broadcast, no errors, multicast only if we joined a group */
+    write_port_byte_pause(nic.base + DP_RCR, DP_RCR_AB | (nic.multicast ? DP_RCR_AM : 0));
     nic.running = true;
 
 #ifdef DEBUG
@@ -155,30 +160,26 @@ static void dp83902a_start_xmit(int start_page, int len)
     nic.tx_started = true;
 }
 
+static inline int tx_slot_page(int slot)
+{
+    return nic.tx_buf_start + slot * NE2000_TX_SLOT_PAGES;
+}
+
 /*
    This routine is called to send data to the hardware.  It is known a-priori
-   that there is free buffer space (nic.tx_next).
+   that there is a free Tx slot (nic.tx_count < nic.tx_slots).
    */
 static void dp83902a_send(void *data, int total_len)
 {
-    int len, start_page, pkt_len, i, isr;
+    int len, start_page, pkt_len, i, isr, slot;
 
     len = pkt_len = total_len;
     if (pkt_len < IEEE_8023_MIN_FRAME)
         pkt_len = IEEE_8023_MIN_FRAME;
 
-    start_page = nic.tx_next;
-    if (nic.tx_next == nic.tx_buf1) {
-        debug_printf("tx1 ");
-        nic.tx1 = start_page;
-        nic.tx1_len = pkt_len;
-        nic.tx_next = nic.tx_buf2;
-    } else {
-        debug_printf("tx2 ");
-        nic.tx2 = start_page;
-        nic.tx2_len = pkt_len;
-        nic.tx_next = nic.tx_buf1;
-    }
+    slot = nic.tx_fill;
+    start_page = tx_slot_page(slot);
+    debug_printf("tx%d ", slot);
 
     debug_printf("total_len=%d pkt_len=%d ", total_len, pkt_len);
 
@@ -218,20 +219,15 @@ static void dp83902a_send(void *data, int total_len)
 
     /* Put data into buffer */
 #ifdef NE2000_16BIT_PIO
-    uint16_t *txptr = (uint16_t*)data;
     if(len & 1)
         len++;
     len = len >> 1;
+    ne2000_pio_out(data, data_port(nic.data), len);
 #else
-    uint8_t *txptr = (uint8_t*)data;
-#endif
-    for(i=0; i<len; i++){
-#ifdef NE2000_16BIT_PIO
-        write_port_word(nic.data, __builtin_bswap16(*(txptr++)));
-#else
-        write_port_byte(nic.data, *(txptr++));
+    ne2000_pio_out(data, data_port(nic.data), len >> 1);
+    if(len & 1)
+        write_port_byte(nic.data, ((uint8_t*)data)[len - 1]);
 #endif
-    }
 
     /* pad with zeroes if required */
     if (total_len < pkt_len) {
@@ -264,13 +260,15 @@ static void dp83902a_send(void *data, int total_len)
     /* Then disable DMA */
     write_port_byte_pause(nic.base + DP_CR, DP_CR_PAGE0 | DP_CR_NODMA | DP_CR_START);
 
+    /* Only now is the slot ready to go on the wire */
+    nic.tx_len[slot] = pkt_len;
+    nic.tx_count++;
+    if (++nic.tx_fill == nic.tx_slots)
+        nic.tx_fill = 0;
+
     /* Start transmit if not already going */
     if (!nic.tx_started) {
-        if (start_page == nic.tx1) {
-            nic.tx_int = 1;  /* Expecting interrupt from BUF1 */
-        } else {
-            nic.tx_int = 2;  /* Expecting interrupt from BUF2 */
-        }
+        nic.tx_xmit = slot;
         dp83902a_start_xmit(start_page, pkt_len);
     }
 }
@@ -279,13 +277,14 @@ static void dp83902a_send(void *data, int total_len)
    This function is called when a packet has been received.  It's job is
    to prepare to unload the packet from the hardware.  Once the length of
    the packet is known, the upper layer of the driver can be told.  When
-   the upper layer is ready to unload the packet, the internal function
-   'dp83902a_recv' will be called to actually fetch it from the hardware.
+   the upper layer is ready to unload the packet, the internal functions
+   'dp83902a_recv_start' and 'dp83902a_recv_data' will be called to
+   actually fetch it from the hardware.
    */
 static void dp83902a_RxEvent(void)
 {
     uint8_t rcv_hdr[4];
-    int i, len, cur;
+    int len, cur;
 
     while (true) {
 #ifdef DEBUG
@@ -309,15 +308,7 @@ static void dp83902a_RxEvent(void)
         write_port_byte_pause(nic.base + DP_CR, DP_CR_RDMA | DP_CR_START);
         io_slow_down();
 
-#ifdef NE2000_16BIT_PIO
-        for (i = 0;  i < sizeof(rcv_hdr)/2; i++) {
-            ((uint16_t*)rcv_hdr)[i] = __builtin_bswap16(read_port_word(nic.data));
-        }
-#else
-        for (i = 0;  i < sizeof(rcv_hdr);) {
-            rcv_hdr[i++] = read_port_byte(nic.data);
-        }
-#endif
+        ne2000_pio_in(rcv_hdr, data_port(nic.data), sizeof(rcv_hdr)/2, 0);
 
 #ifdef DEBUG
         printf("ne2000: rx header %02x %02x %02x %02x\n",
@@ -346,9 +337,13 @@ static void dp83902a_RxEvent(void)
 /*
    This function is called as a result of the "eth_drv_recv()" call above.
    It's job is to actually fetch data for a packet from the hardware once
-   memory buffers have been allocated for the packet.
+   memory buffers have been allocated for the packet. The data is then read
+   in one or more pieces with dp83902a_recv_data(); every piece but the
+   last must be an even length. As the data is read we accumulate the
+   Internet checksum of the whole frame in nic.rx_sum, which saves the
+   network layer another pass over the data to verify it.
    */
-static void dp83902a_recv(uint8_t *data, int len)
+static void dp83902a_recv_start(int len)
 {
     /* Read incoming packet data */
     write_port_byte_pause(nic.base + DP_CR, DP_CR_PAGE0 | DP_CR_NODMA | DP_CR_START);
@@ -360,59 +355,55 @@ static void dp83902a_recv(uint8_t *data, int len)
     io_slow_down();
     write_port_byte_pause(nic.base + DP_CR, DP_CR_RDMA | DP_CR_START);
     io_slow_down();
+    nic.rx_sum = 0;
+}
 
-#ifdef NE2000_16BIT_PIO
-    uint16_t *dptr = (uint16_t*)data;
-    len = (len+1) >> 1;
-#else
-    uint8_t *dptr = data;
-#endif
+static void dp83902a_recv_data(uint8_t *data, int len)
+{
+    /* a frame is at most 768 words, so 32 bits cannot overflow */
+    uint32_t sum = ne2000_pio_in(data, data_port(nic.data), len >> 1, nic.rx_sum);
 
-    for(int i=0; i<len; i++){
+    if(len & 1){
 #ifdef NE2000_16BIT_PIO
-        *(dptr++) = __builtin_bswap16(read_port_word(nic.data));
+        uint16_t w = __builtin_bswap16(read_port_word(nic.data));
+        *(uint16_t*)(data + len - 1) = w;
+        sum += w & 0xff00; /* low byte is beyond the end */
 #else
-        *(dptr++) = read_port_byte(nic.data);
+        uint8_t hi = read_port_byte(nic.data);
+        data[len - 1] = hi;
+        sum += hi << 8;
 #endif
     }
+    nic.rx_sum = sum;
 }
 
 static void dp83902a_TxEvent(void)
 {
-    uint8_t __attribute__((unused)) tsr;
+    uint8_t tsr;
 
     tsr = read_port_byte(nic.base + DP_TSR);
-    if (nic.tx_int == 1) {
-        debug_printf("f1 ");
-        nic.tx1 = 0;
-    } else {
-        debug_printf("f2 ");
-        nic.tx2 = 0;
-    }
-
-    /* Start next packet if one is ready */
+    nic.counters.tx_collisions += read_port_byte(nic.base + DP_NCR) & 0x0F;
+    if (tsr & DP_TSR_ABT)
+        nic.counters.tx_aborted++;
+    debug_printf("f%d ", nic.tx_xmit);
+    nic.tx_count--;
+    if (++nic.tx_xmit == nic.tx_slots)
+        nic.tx_xmit = 0;
+
+    /* Chain straight on to the next slot if one is ready */
     nic.tx_started = false;
 
-    if (nic.tx1) {
-        dp83902a_start_xmit(nic.tx1, nic.tx1_len);
-        nic.tx_int = 1;
-    } else if (nic.tx2) {
-        dp83902a_start_xmit(nic.tx2, nic.tx2_len);
-        nic.tx_int = 2;
-    } else {
-        nic.tx_int = 0;
-    }
+    if (nic.tx_count)
+        dp83902a_start_xmit(tx_slot_page(nic.tx_xmit), nic.tx_len[nic.tx_xmit]);
 }
 
-/* Read the tally counters to clear them.  Called in response to a CNT */
-/* interrupt. */
+/* Read the tally counters (which clears them) into our cumulative totals. */
+/* Called in response to a CNT interrupt, and before reporting the totals. */
 static void dp83902a_ClearCounters(void)
 {
-    uint8_t __attribute__((unused)) cnt1, cnt2, cnt3;
-
-    cnt1 = read_port_byte(nic.base + DP_FER);
-    cnt2 = read_port_byte(nic.base + DP_CER);
-    cnt3 = read_port_byte(nic.base + DP_MISSED);
+    nic.counters.rx_frame_errors += read_port_byte(nic.base + DP_FER);
+    nic.counters.rx_crc_errors += read_port_byte(nic.base + DP_CER);
+    nic.counters.rx_missed += read_port_byte(nic.base + DP_MISSED);
     write_port_byte_pause(nic.base + DP_ISR, DP_ISR_CNT);
 }
 
@@ -422,7 +413,7 @@ static void dp83902a_Overflow(void)
 {
     uint8_t isr;
 
-    printf("ne2000: overflow\n");
+    nic.counters.rx_overflows++;
 
     /* Issue a stop command and wait 1.6ms for it to complete. */
     write_port_byte_pause(nic.base + DP_CR, DP_CR_STOP | DP_CR_NODMA);
@@ -578,15 +569,46 @@ static void push_packet_ready(int len)
 {
     debug_printf("pushed len = %d\n", len);
 
+    int head, steered;
+
     packet_t *packet = packet_alloc(len);
-    if(!packet){
-        printf("ne2000: no free rx buffer\n");
+    if(!packet) // no free buffer; leave it in the ring to be discarded
         return;
+
+    dp83902a_recv_start(len);
+
+    // read the headers first, so the data can go straight to its destination
+    head = (len < NET_STEER_HEADER) ? len : NET_STEER_HEADER;
+    dp83902a_recv_data(packet->buffer, head);
+    if(head < len){
+        steered = net_eth_steer(packet, len);
+        if(steered){
+            dp83902a_recv_data(packet->steered_data, steered);
+            head += steered;
+        }
+        // whatever remains (everything, or just the padding/CRC) goes in the packet
+        if(head < len)
+            dp83902a_recv_data(packet->buffer + head, len - head);
     }
-    dp83902a_recv(packet->buffer, packet->buffer_length);
+
+    packet->rx_sum = nic.rx_sum;
+    packet->flags |= packet_flag_rx_sum_valid;
     net_eth_push(packet);
 }
 
+/* Tx slots from tx_buf_start up, the Rx ring gets the rest (but never less than 5KB) */
+static void ne2000_partition(int tx_slots)
+{
+    if(tx_slots > NE2000_TX_SLOTS_MAX)
+        tx_slots = NE2000_TX_SLOTS_MAX;
+    while(tx_slots > 1 && nic.rx_buf_end - tx_slot_page(tx_slots) < NE2000_RX_MIN_PAGES)
+        tx_slots--;
+    if(tx_slots < 1)
+        tx_slots = 1;
+    nic.tx_slots = tx_slots;
+    nic.rx_buf_start = tx_slot_page(tx_slots);
+}
+
 bool eth_init(void)
 {
     for(int i=0; portlist[i]; i++){
@@ -596,17 +618,17 @@ bool eth_init(void)
         if(!get_prom())
             continue;
 
-        nic.tx_buf1 = 0x40; /* 6x256=1.5KB */
-        nic.tx_buf2 = 0x46; /* 6x256=1.5KB */
-        nic.rx_buf_start = 0x4C;
+        nic.tx_buf_start = 0x40;
 #ifndef NE2000_16BIT_PIO
         /* 8 bit IO */
         if(nic.rtl8019){
             /* RTL8019 in 8-bit mode requires that we not exceed page 0x60 */
-            nic.rx_buf_end = 0x60; /* 20x256=5KB */
+            nic.rx_buf_end = 0x60;
         }else
 #endif
-            nic.rx_buf_end = 0x80; /* 52x256=13KB */
+            nic.rx_buf_end = 0x80;
+
+        ne2000_partition(NE2000_TX_SLOTS);
 
         printf("%s at 0x%x, MAC %02x:%02x:%02x:%02x:%02x:%02x\n",
                 nic.rtl8019 ? "RTL8019" : "NE2000",
@@ -634,6 +656,100 @@ int eth_rxbuffer_size(void)
     return r;
 }
 
+int eth_rxbuffer_max_size(void)
+{
+    if(!nic.base)
+        return 0;
+    return (nic.rx_buf_end - tx_slot_page(1)) << 8; // with a single Tx slot
+}
+
+/* Repartition the card memory. Call between transfers: frames already
+   queued for transmit are allowed to drain, but anything waiting in the
+   receive ring is lost when the card restarts. Returns the slot count
+   actually used, which may be fewer than requested. */
+int eth_set_tx_slots(int slots)
+{
+    timer_t timeout;
+
+    if(!nic.base)
+        return 0;
+
+    timeout = set_timer_ms(100);
+    while(nic.tx_count && !timer_expired(timeout))
+        dp83902a_poll();
+
+    dp83902a_stop();
+    ne2000_partition(slots);
+    dp83902a_start(interface_macaddr);
+
+    return nic.tx_slots;
+}
+
+uint32_t eth_overflow_count(void)
+{
+    return nic.counters.rx_overflows;
+}
+
+const eth_counters_t *eth_counters(void)
+{
+    if(nic.base){
+        write_port_byte_pause(nic.base + DP_CR, DP_CR_NODMA | DP_CR_PAGE0 | DP_CR_START);
+        dp83902a_ClearCounters();
+    }
+    return &nic.counters;
+}
+
+void eth_counters_reset(void)
+{
+    eth_counters(); // discard whatever the card has tallied so far
+    memset(&nic.counters, 0, sizeof(nic.counters));
+}
+
+int eth_tx_slots(void)
+{
+    return nic.base ? nic.tx_slots : 0;
+}
+
+/* the 8390 hashes the destination of each multicast frame with the ethernet
+   CRC and accepts it if the bit indexed by the top 6 bits is set in MAR0-7 */
+static uint32_t ether_crc(const uint8_t *data, int length)
+{
+    uint32_t crc = 0xffffffff;
+    uint8_t octet;
+
+    while(length--){
+        octet = *data++;
+        for(int bit=0; bit<8; bit++, octet >>= 1)
+            crc = (crc << 1) ^ (((crc >> 31) ^ (octet & 1)) ? 0x04c11db7 : 0);
+    }
+
+    return crc;
+}
+
+/* Replace the set of multicast groups we receive; count == 0 turns
+   multicast reception off. Hash collisions let through some frames for
+   other groups, so the IP layer still filters on the group address. */
+void eth_set_multicast_list(const macaddr_t *list, int count)
+{
+    int i, hash;
+
+    memset(nic.mar, 0, sizeof(nic.mar));
+    for(i=0; i<count; i++){
+        hash = ether_crc(list[i], sizeof(macaddr_t)) >> 26;
+        nic.mar[hash >> 3] |= 1 << (hash & 7);
+    }
+    nic.multicast = (count > 0);
+
+    if(!nic.base || !nic.running)
+        return;
+
+    write_port_byte_pause(nic.base + DP_CR, DP_CR_PAGE1 | DP_CR_NODMA | DP_CR_START);
+    for(i=0; i<8; i++)
+        write_port_byte_pause(nic.base + DP_P1_MAR0+i, nic.mar[i]);
+    write_port_byte_pause(nic.base + DP_CR, DP_CR_PAGE0 | DP_CR_NODMA | DP_CR_START);
+    write_port_byte_pause(nic.base + DP_RCR, DP_RCR_AB | (nic.multicast ? DP_RCR_AM : 0));
+}
+
 void eth_halt(void)
 {
     if(nic.base)
@@ -649,7 +765,8 @@ static bool eth_tx(uint8_t *packet, int length)
         printf("ne2000: tx too big\n");
         return false;
     }
-    if(nic.tx1 && nic.tx2){
+    if(nic.tx_count == nic.tx_slots){
+        nic.counters.tx_full++;
         return false;
     }else{
         dp83902a_send(packet, length);
@@ -671,7 +788,7 @@ void eth_pump(void)
 
     dp83902a_poll();
 
-    while(!(nic.tx1 && nic.tx2)){
+    while(nic.tx_count < nic.tx_slots){
         packet = net_eth_pull();
         if(!packet)
             break;
@@ -5,6 +5,7 @@
 #include <timers.h>
 #include <cli.h>
 #include <net.h>
+#include <task.h>
 
 macaddr_t const broadcast_macaddr = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 macaddr_t interface_macaddr; // MAC address of our interface
@@ -14,82 +15,81 @@ uint32_t interface_subnet_mask = 0;
 uint32_t interface_ipv4_gateway = 0;
 uint32_t interface_dns_server = 0;
 
-static packet_sink_t *net_packet_sink_head = NULL;
+#define SINK_HASH_SIZE 16 /* power of two */
+
+static packet_sink_t *net_packet_sink_head = NULL;           // all sinks, most specific first
+static packet_sink_t *net_sink_hash[SINK_HASH_SIZE];         // sinks keyed on (protocol, local port)
+static packet_sink_t *net_sink_wildcard_head = NULL;         // sinks without a protocol and local port
+static packet_sink_t *net_sink_ready_head = NULL;            // sinks with packets queued
 static packet_queue_t *net_txqueue = NULL;
-static packet_t *net_arp_lookup_list_head = NULL;
 
 uint32_t packet_alive_count = 0;
+uint32_t packet_pool_size = 0;
+uint32_t packet_pool_high_water = 0;
+uint32_t packet_pool_exhausted_count = 0;
 uint32_t packet_discard_count = 0;
 uint32_t packet_bad_cksum_count = 0;
 uint32_t packet_rx_count = 0;
 uint32_t packet_tx_count = 0;
+uint32_t packet_sink_lookup_count = 0;
 
 void net_init(void)
 {
+    packet_pool_init();
+    net_ipv4_reassembly_init();
     net_txqueue = packet_queue_alloc();
-    net_arp_lookup_list_head = NULL;
     net_arp_init();
     net_icmp_init();
+    net_igmp_init();
 }
 
-static void net_arp_resolver_pump(void)
+void net_counters_reset(void)
 {
-    packet_t *packet, **packet_ptr;
-    arp_result_t r;
-
-    packet = net_arp_lookup_list_head;
-    packet_ptr = &net_arp_lookup_list_head;
-
-    while(packet){
-        r = net_arp_resolve(packet);
-        if(r == arp_wait){
-            // walk forward in the list
-            packet_ptr = &packet->next;
-            packet = packet->next;
-        }else{
-            // remove it from the arp lookup list
-            *packet_ptr = packet->next;
-            packet->next = NULL;
-
-            if(r == arp_okay){
-                // move it onto the transmit queue
-                packet_queue_addtail(net_txqueue, packet);
-            }else{ // r == arp_fail
-                // we couldn't resolve it
-                packet_free(packet);
-            }
-
-            // walk forward in the list
-            // do not update packet_ptr
-            packet = *packet_ptr;
-        }
-    }
+    packet_pool_high_water = packet_alive_count;
+    packet_pool_exhausted_count = 0;
+    packet_discard_count = 0;
+    packet_bad_cksum_count = 0;
+    packet_rx_count = 0;
+    packet_tx_count = 0;
+    packet_sink_lookup_count = 0;
+    ipv4_reassembly_failures = 0;
+    eth_counters_reset();
 }
 
 void net_pump(void)
 {
     packet_t *packet;
-
-    // progress any queued ARP lookups
-    net_arp_resolver_pump();
+    packet_sink_t *sink, *next;
 
     // pump the hardware driver
     eth_pump(); // calls net_eth_push, net_eth_pull
+    net_ipv4_reassembly_expire();
 
-    // pump each sink with data waiting or an expired timer
-    packet_sink_t *sink = net_packet_sink_head;
-    while(sink){
+    // pump each sink with data waiting
+    while((sink = net_sink_ready_head)){
+        net_sink_ready_head = sink->ready_next;
+        sink->ready_next = NULL;
+        sink->ready = false;
         if(sink->cb_packet_received){
             while((packet = packet_queue_pophead(&sink->queue)))
                 sink->cb_packet_received(sink, packet);
         }
+    }
+
+    // pump each sink with an expired timer
+    sink = net_packet_sink_head;
+    while(sink){
+        next = sink->next; // callback may remove the sink
         if(sink->cb_timer_expired && sink->timer && timer_expired(sink->timer)){
             sink->timer = 0; // disable timer
             sink->cb_timer_expired(sink);
         }
         // walk linked list
-        sink = sink->next;
+        sink = next;
     }
+
+    // background jobs
+    task_pump();
 }
 
 static int score_sink(packet_sink_t *sink)
@@ -110,69 +110,111 @@ static int score_sink(packet_sink_t *sink)
     return matches;
 }
 
-void net_add_packet_sink(packet_sink_t *sink)
+static inline int sink_hash(uint8_t protocol, uint16_t local_port)
+{
+    return (local_port ^ (local_port >> 8) ^ protocol) & (SINK_HASH_SIZE - 1);
+}
+
+// sinks matching a specific protocol and local port are found via the hash
+// table, all others are on the wildcard list
+static packet_sink_t **sink_demux_list(packet_sink_t *sink)
+{
+    if(sink->match_ipv4_protocol && sink->match_local_port)
+        return &net_sink_hash[sink_hash(sink->match_ipv4_protocol, sink->match_local_port)];
+    return &net_sink_wildcard_head;
+}
+
+static inline packet_sink_t **sink_link(packet_sink_t *sink, bool demux)
+{
+    return demux ? &sink->demux_next : &sink->next;
+}
+
+static void sink_list_insert(packet_sink_t **head, packet_sink_t *sink, bool demux)
 {
     int score;
     packet_sink_t **ptr;
     packet_sink_t *entry;
 
-    if(sink->next){
-        printf("net_add_packet_sink: already in a list?\n");
-        return;
-    }
-
-    // first sink?
-    if(net_packet_sink_head == NULL){
-        net_packet_sink_head = sink;
-        return;
-    }
-
     // count how many parameters this sink matches against
     score = score_sink(sink);
 
     // place it in the list in sorted order: we want to test
     // the most specific sinks first
-    ptr = &net_packet_sink_head;
-    entry = net_packet_sink_head;
+    ptr = head;
+    entry = *head;
     while(entry){
-        if(score_sink(entry) <= score){
-            // insert
-            *ptr = sink;
-            sink->next = entry;
-            return;
-        }
-        if(entry->next == NULL){
-            entry->next = sink;
-            return;
-        }
+        if(score_sink(entry) <= score)
+            break;
         // walk list
-        ptr = &entry->next;
-        entry = entry->next;
+        ptr = sink_link(entry, demux);
+        entry = *ptr;
     }
+
+    // insert
+    *ptr = sink;
+    *sink_link(sink, demux) = entry;
 }
 
-void net_remove_packet_sink(packet_sink_t *sink)
+static bool sink_list_remove(packet_sink_t **head, packet_sink_t *sink, bool demux)
 {
     packet_sink_t **ptr;
     packet_sink_t *entry;
 
-    ptr = &net_packet_sink_head;
-    entry = net_packet_sink_head;
+    ptr = head;
+    entry = *head;
 
     while(entry){
         if(entry == sink){
             // we got it!
-            *ptr = entry->next;
-            entry->next = NULL;
-            return;
+            *ptr = *sink_link(entry, demux);
+            *sink_link(entry, demux) = NULL;
+            return true;
         }else{
             // walk list
-            ptr = &entry->next;
-            entry = entry->next;
+            ptr = sink_link(entry, demux);
+            entry = *ptr;
         }
     }
 
-    printf("net_remove_packet_sink: can't find it?\n");
+    return false;
+}
+
+void net_add_packet_sink(packet_sink_t *sink)
+{
+    if(sink->next || sink == net_packet_sink_head){
+        printf("net_add_packet_sink: already in a list?\n");
+        return;
+    }
+
+    sink_list_insert(&net_packet_sink_head, sink, false);
+    sink_list_insert(sink_demux_list(sink), sink, true);
+
+    // packets may have been queued while it was out of the list (eg
+    // while changing match criteria)
+    if(packet_queue_peekhead(&sink->queue) && !sink->ready){
+        sink->ready = true;
+        sink->ready_next = net_sink_ready_head;
+        net_sink_ready_head = sink;
+    }
+}
+
+void net_remove_packet_sink(packet_sink_t *sink)
+{
+    if(!sink_list_remove(&net_packet_sink_head, sink, false)){
+        printf("net_remove_packet_sink: can't find it?\n");
+        return;
+    }
+
+    sink_list_remove(sink_demux_list(sink), sink, true);
+
+    if(sink->ready){
+        packet_sink_t **ptr = &net_sink_ready_head;
+        while(*ptr != sink)
+            ptr = &(*ptr)->ready_next;
+        *ptr = sink->ready_next;
+        sink->ready_next = NULL;
+        sink->ready = false;
+    }
 }
 
 void net_dump_packet_sinks(void) // used by "netinfo" command
@@ -201,6 +243,104 @@ void net_dump_packet_sinks(void) // used by "netinfo" command
 
 // --- receive pipe ---
 
+static packet_sink_t *net_find_sink(packet_t *packet)
+{
+    packet_sink_t *sink;
+
+    // figure out the best matching queue to put it into
+    // convert key fields to cpu byte order (avoids doing this for every sink)
+    uint16_t ethertype        = ntohs(packet->eth->ethertype);
+    uint16_t protocol         = packet->ipv4 ? packet->ipv4->protocol : 0;
+    uint32_t destination_ip   = packet->ipv4 ? ntohl(packet->ipv4->destination_ip) : 0;
+    uint32_t source_ip        = packet->ipv4 ? ntohl(packet->ipv4->source_ip) : 0;
+    uint16_t destination_port = packet->tcp ? ntohs(packet->tcp->destination_port) : (packet->udp ? ntohs(packet->udp->destination_port) : 0);
+    uint16_t source_port      = packet->tcp ? ntohs(packet->tcp->source_port)      : (packet->udp ? ntohs(packet->udp->source_port)      : 0);
+
+#define SINK_MATCHES(sink) \
+            ((sink->match_ethertype == 0      || (sink->match_ethertype == ethertype)) && \
+             (sink->match_ipv4_protocol == 0  || (packet->ipv4 && sink->match_ipv4_protocol == protocol)) && \
+             (sink->match_local_ip == 0       || (packet->ipv4 && sink->match_local_ip == destination_ip)) && \
+             (!sink->match_interface_local_ip || (packet->ipv4 && interface_ipv4_address && interface_ipv4_address == destination_ip)) && \
+             (sink->match_remote_ip == 0      || (packet->ipv4 && sink->match_remote_ip == source_ip)) && \
+             (sink->match_local_port == 0     || ((packet->tcp || packet->udp) && sink->match_local_port == destination_port)) && \
+             (sink->match_remote_port == 0    || ((packet->tcp || packet->udp) && sink->match_remote_port == source_port)))
+
+    // first try the sinks listening on this protocol and port
+    if(packet->tcp || packet->udp){
+        for(sink = net_sink_hash[sink_hash(protocol, destination_port)]; sink; sink = sink->demux_next){
+            packet_sink_lookup_count++;
+            if(SINK_MATCHES(sink))
+                return sink;
+        }
+    }
+
+    // then those that are less specific
+    for(sink = net_sink_wildcard_head; sink; sink = sink->demux_next){
+        packet_sink_lookup_count++;
+        if(SINK_MATCHES(sink))
+            return sink;
+    }
+
+#undef SINK_MATCHES
+
+    return NULL;
+}
+
+// called by ne2000.c when only the first NET_STEER_HEADER bytes of a frame
+// 'length' bytes long have been read from the card. if the sink that will
+// receive it wants to place the data itself, we set packet->steered_data and
+// return the number of data bytes the driver should read directly into it.
+// all checks are repeated by net_eth_push once the whole frame is in.
+int net_eth_steer(packet_t *packet, int length)
+{
+    packet_sink_t *sink;
+    uint8_t *dest;
+    int udp_length, steer_length;
+
+    // only unicast, unfragmented IPv4 UDP without IP options is steered
+    if(memcmp(packet->eth->destination_mac, interface_macaddr, sizeof(macaddr_t)) != 0 ||
+       packet->eth->ethertype != htons(ethertype_ipv4))
+        return 0;
+
+    packet->ipv4 = (ipv4_header_t*)packet->eth->payload;
+    if(packet->ipv4->version_length != 0x45 ||
+       packet->ipv4->protocol != ip_proto_udp ||
+       (packet->ipv4->flags_and_frags & htons(0x3fff)) ||
+       !net_verify_ipv4_checksum(packet))
+        goto no_steer;
+
+    packet->udp = (udp_header_t*)packet->ipv4->payload;
+    udp_length = ntohs(packet->udp->length);
+    if(udp_length + sizeof(ipv4_header_t) + sizeof(ethernet_header_t) > length)
+        goto no_steer;
+
+    // the steered part must be an even length to keep 16-bit transfers aligned
+    steer_length = udp_length - sizeof(udp_header_t) - NET_STEER_PEEK;
+    if(steer_length <= 0 || (steer_length & 1))
+        goto no_steer;
+
+    packet->data = packet->udp->payload;
+    packet->data_length = udp_length - sizeof(udp_header_t);
+
+    sink = net_find_sink(packet);
+    if(!sink || !sink->cb_steer_payload)
+        goto no_steer;
+
+    dest = sink->cb_steer_payload(sink, packet, steer_length);
+    if(!dest || ((uint32_t)dest & 1))
+        goto no_steer;
+
+    packet->steered_data = dest;
+    return steer_length;
+
+no_steer:
+    packet->ipv4 = NULL;
+    packet->udp = NULL;
+    packet->data = NULL;
+    packet->data_length = 0;
+    return 0;
+}
+
 // called by ne2000.c via eth_pump()
 // this function should check and queue a packet for later delivery
 // to prevent potential re-entrancy, do NOT make any callbacks to sinks in here
@@ -219,17 +359,30 @@ void net_eth_push(packet_t *packet)
                 packet->ipv4 = (ipv4_header_t*)packet->eth->payload;
                 if(!net_verify_ipv4_checksum(packet))
                     goto bad_cksum;
+                if(packet->ipv4->flags_and_frags & htons(0x3fff)){ // more fragments, or fragment offset
+                    packet = net_ipv4_reassemble(packet);
+                    if(!packet)
+                        return; // kept until the rest arrive, or dropped
+                }
                 switch(packet->ipv4->protocol){
                     case ip_proto_tcp:
-                        header_size = ((packet->tcp->data_offset & 0x0F) << 2);
                         packet->tcp = (tcp_header_t*)packet->ipv4->payload;
+                        header_size = ((packet->tcp->data_offset >> 4) << 2);
+                        // the header length is the peer's to choose; keep data_length inside the packet
+                        if(header_size < (int)sizeof(tcp_header_t) ||
+                           ntohs(packet->ipv4->length) < sizeof(ipv4_header_t) + header_size ||
+                           sizeof(ethernet_header_t) + ntohs(packet->ipv4->length) > packet->buffer_length)
+                            goto discard;
                         packet->data = packet->ipv4->payload + header_size;
-                        packet->data_length = ntohs(packet->ipv4->length) - header_size;
+                        packet->data_length = ntohs(packet->ipv4->length) - sizeof(ipv4_header_t) - header_size;
                         if(!net_verify_tcp_checksum(packet))
                             goto bad_cksum;
                         break;
                     case ip_proto_udp:
-                        packet->udp = (udp_header_t*)packet->ipv4->payload;
+                        if(packet->reassembly_buffer)
+                            packet->udp = (udp_header_t*)packet->reassembly_buffer;
+                        else
+                            packet->udp = (udp_header_t*)packet->ipv4->payload;
                         packet->data = packet->udp->payload;
                         packet->data_length = ntohs(packet->udp->length) - sizeof(udp_header_t);
                         if(!net_verify_udp_checksum(packet))
@@ -242,6 +395,15 @@ void net_eth_push(packet_t *packet)
                         if(!net_verify_icmp_checksum(packet))
                             goto bad_cksum;
                         break;
+                    case ip_proto_igmp:
+                        // routers send these with a router alert option
+                        header_size = (packet->ipv4->version_length & 0x0f) << 2;
+                        if(ntohs(packet->ipv4->length) < header_size + sizeof(igmp_header_t))
+                            break;
+                        packet->igmp = (igmp_header_t*)((uint8_t*)packet->ipv4 + header_size);
+                        if(!net_verify_igmp_checksum(packet))
+                            goto bad_cksum;
+                        break;
                     default:
                         // unhandled ipv4 protocol
                         break;
@@ -255,33 +417,22 @@ void net_eth_push(packet_t *packet)
                 break;
         }
 
-        // figure out the best matching queue to put it into
-        // convert key fields to cpu byte order (avoids doing this for every sink)
-        uint16_t ethertype        = ntohs(packet->eth->ethertype);
-        uint16_t protocol         = ntohs(packet->ipv4->protocol);
-        uint32_t destination_ip   = ntohl(packet->ipv4->destination_ip);
-        uint32_t source_ip        = ntohl(packet->ipv4->source_ip);
-        uint16_t destination_port = packet->tcp ? ntohs(packet->tcp->destination_port) : (packet->udp ? ntohs(packet->udp->destination_port) : 0);
-        uint16_t source_port      = packet->tcp ? ntohs(packet->tcp->source_port)      : (packet->udp ? ntohs(packet->udp->source_port)      : 0);
-        packet_sink_t *sink = net_packet_sink_head;
-        while(sink){
-            if( (sink->match_ethertype == 0      || (sink->match_ethertype == ethertype)) &&
-                (sink->match_ipv4_protocol == 0  || (packet->ipv4 && sink->match_ipv4_protocol == protocol)) &&
-                (sink->match_local_ip == 0       || (packet->ipv4 && sink->match_local_ip == destination_ip)) &&
-                (!sink->match_interface_local_ip || (packet->ipv4 && interface_ipv4_address && interface_ipv4_address == destination_ip)) &&
-                (sink->match_remote_ip == 0      || (packet->ipv4 && sink->match_remote_ip == source_ip)) &&
-                (sink->match_local_port == 0     || ((packet->tcp || packet->udp) && sink->match_local_port == destination_port)) &&
-                (sink->match_remote_port == 0    || ((packet->tcp || packet->udp) && sink->match_remote_port == source_port)) ){
-                // enqueue the packet for later processing
-                packet_queue_addtail(&sink->queue, packet);
-                sink->packets_queued++;
-                return;
+        packet_sink_t *sink = net_find_sink(packet);
+        if(sink){
+            // enqueue the packet for later processing
+            packet_queue_addtail(&sink->queue, packet);
+            sink->packets_queued++;
+            if(!sink->ready){
+                sink->ready = true;
+                sink->ready_next = net_sink_ready_head;
+                net_sink_ready_head = sink;
             }
-            sink = sink->next;
+            return;
         }
     }
 
     // if we didn't find a queue, discard it.
+discard:
     packet_discard_count++;
     packet_free(packet);
     return;
@@ -309,6 +460,9 @@ static void net_ipv4_route(packet_t *packet)
 
 void net_tx(packet_t *packet)
 {
+    if(!packet) // allocation failed; drop it
+        return;
+
     // don't transmit from 0.0.0.0 unless it's DHCP
     if(packet->ipv4 && packet->ipv4->source_ip == htonl(0) &&
             !(packet->udp && packet->udp->source_port == 68 && packet->udp->destination_port == 67)){
@@ -318,7 +472,7 @@ void net_tx(packet_t *packet)
     }
 
     // compute checksums
-    if(packet->eth->ethertype == ethertype_ipv4){
+    if(packet->eth->ethertype == ethertype_ipv4 && !(packet->flags & packet_flag_checksums_valid)){
         net_compute_ipv4_checksum(packet);
         switch(packet->ipv4->protocol){
             case ip_proto_tcp:
@@ -330,27 +484,49 @@ void net_tx(packet_t *packet)
             case ip_proto_icmp:
                 net_compute_icmp_checksum(packet);
                 break;
+            case ip_proto_igmp:
+                net_compute_igmp_checksum(packet);
+                break;
         }
     }
 
+    // multicast groups map straight onto ethernet group addresses; no ARP
+    if(packet->ipv4 && !(packet->flags & packet_flag_destination_mac_valid) &&
+            ipv4_is_multicast(ntohl(packet->ipv4->destination_ip))){
+        net_multicast_macaddr(ntohl(packet->ipv4->destination_ip), &packet->eth->destination_mac);
+        packet->flags |= packet_flag_destination_mac_valid;
+    }
+
     net_ipv4_route(packet);
 
     packet_tx_count++;
 
-    if(packet->flags & packet_flag_destination_mac_valid || net_arp_resolve(packet) == arp_okay){
-        // we want to start the transmission immediately if we have buffer space on the card,
-        // otherwise we have to queue the packet for transmission later
-        if(eth_attempt_tx(packet))
-            packet_free(packet);
-        else
-            packet_queue_addtail(net_txqueue, packet);
+    if(packet->flags & packet_flag_destination_mac_valid){
+        net_tx_resolved(packet);
     }else{
-        // add to the list of packets awaiting ARP resolution
-        packet->next = net_arp_lookup_list_head;
-        net_arp_lookup_list_head = packet;
+        switch(net_arp_resolve(packet)){
+            case arp_okay:
+                net_tx_resolved(packet);
+                break;
+            case arp_wait: // ARP holds the packet until the address resolves
+                break;
+            case arp_fail:
+                packet_free(packet);
+                break;
+        }
     }
 }
 
+void net_tx_resolved(packet_t *packet)
+{
+    // we want to start the transmission immediately if we have buffer space on the card,
+    // otherwise we have to queue the packet for transmission later
+    if(eth_attempt_tx(packet))
+        packet_free(packet);
+    else
+        packet_queue_addtail(net_txqueue, packet);
+}
+
 // called by ne2000.c via eth_pump()
 // this function should dequeue a packet for delivery
 // to prevent potential re-entrancy, do NOT make any callbacks to sinks in here
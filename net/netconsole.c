@@ -0,0 +1,157 @@
+/* (c) 2023 William R Sowerbutts <will@sowerbutts.com> */
+
+#include <types.h>
+#include <stdlib.h>
+#include <timers.h>
+#include <uart.h>
+#include <net.h>
+
+// A console over UDP, much like Linux's netconsole: console output is
+// batched into datagrams sent to a remote host ("nc -u -l 6666" will show
+// it) and datagrams from that host are fed to console input. The UART can
+// carry on in parallel, or be switched off so printf runs at ethernet speed
+// rather than being throttled to 115200 baud.
+
+#define NETCONSOLE_PORT   6666
+#define OUTPUT_MAX        1024  // bytes per datagram
+#define INPUT_MAX          256  // must be a power of 2
+#define FLUSH_MS            20  // longest we sit on a partial line, and the least time between datagrams
+#define DRAIN_MS           100  // on stop, time allowed for the last datagram to go out
+
+static packet_sink_t *netconsole_sink = NULL;
+static uint32_t netconsole_ip;
+static uint16_t netconsole_port;
+static bool netconsole_uart;
+static char output[OUTPUT_MAX];
+static int output_length;
+static bool output_busy;            // in netconsole_flush(); anything printed meanwhile skips the network
+static timer_t last_flush;
+static uint8_t input[INPUT_MAX];
+static unsigned int input_head, input_tail;
+static uint32_t netconsole_dropped; // output bytes lost for want of a packet buffer
+
+static void netconsole_flush(void)
+{
+    packet_t *packet;
+
+    if(!output_length || output_busy || !interface_ipv4_address)
+        return;
+
+    output_busy = true;
+    packet = packet_create_udp(netconsole_ip, netconsole_port, NETCONSOLE_PORT, output_length);
+    if(packet){
+        memcpy(packet->data, output, output_length);
+        net_tx(packet);
+    }else
+        netconsole_dropped += output_length;
+    output_length = 0;
+    last_flush = gogoboot_read_timer();
+    netconsole_sink->timer = 0;
+    output_busy = false;
+}
+
+static void netconsole_write_byte(char b)
+{
+    if(b == '\r' || output_busy) // putch() adds the CRs for the UART's benefit
+        return;
+
+    if(output_length == OUTPUT_MAX){
+        netconsole_flush();
+        if(output_length == OUTPUT_MAX){ // no address yet
+            netconsole_dropped++;
+            return;
+        }
+    }
+
+    output[output_length++] = b;
+
+    // a line at a time, unless lines are coming thick and fast; then fill datagrams
+    if(b == '\n' && (gogoboot_read_timer() - last_flush) * TIMER_MS_PER_TICK >= FLUSH_MS)
+        netconsole_flush();
+    else if(!netconsole_sink->timer)
+        netconsole_sink->timer = set_timer_ms(FLUSH_MS);
+}
+
+static int netconsole_read_byte(void)
+{
+    if(input_head == input_tail)
+        return -1;
+    return input[input_tail++ & (INPUT_MAX-1)];
+}
+
+static void netconsole_received(packet_sink_t *sink, packet_t *packet)
+{
+    uint8_t b;
+
+    for(int i=0; i<packet->data_length && input_head - input_tail < INPUT_MAX; i++){
+        b = packet->data[i];
+        input[input_head++ & (INPUT_MAX-1)] = (b == '\n') ? '\r' : b;
+    }
+
+    packet_free(packet);
+}
+
+static void netconsole_timer_expired(packet_sink_t *sink)
+{
+    netconsole_flush();
+}
+
+void netconsole_start(uint32_t ip, uint16_t port, bool uart_output)
+{
+    netconsole_stop();
+
+    netconsole_ip = ip;
+    netconsole_port = port ? port : NETCONSOLE_PORT;
+    netconsole_uart = uart_output;
+    netconsole_dropped = 0;
+    output_length = 0;
+    input_head = input_tail = 0;
+    last_flush = gogoboot_read_timer();
+
+    netconsole_sink = packet_sink_alloc();
+    netconsole_sink->match_ethertype = ethertype_ipv4;
+    netconsole_sink->match_ipv4_protocol = ip_proto_udp;
+    netconsole_sink->match_local_port = NETCONSOLE_PORT;
+    netconsole_sink->match_remote_ip = ip;
+    netconsole_sink->cb_packet_received = netconsole_received;
+    netconsole_sink->cb_timer_expired = netconsole_timer_expired;
+    net_add_packet_sink(netconsole_sink);
+
+    uart_set_console_hooks(netconsole_write_byte, netconsole_read_byte, uart_output);
+}
+
+void netconsole_stop(void)
+{
+    timer_t drain;
+
+    if(!netconsole_sink)
+        return;
+
+    netconsole_flush();
+    uart_set_console_hooks(NULL, NULL, true);
+
+    // give the last datagram (and any ARP exchange it needs) a chance to leave
+    drain = set_timer_ms(DRAIN_MS);
+    while(!timer_expired(drain))
+        net_pump();
+
+    net_remove_packet_sink(netconsole_sink);
+    packet_sink_free(netconsole_sink);
+    netconsole_sink = NULL;
+}
+
+void netconsole_report(void)
+{
+    if(!netconsole_sink){
+        printf("netconsole: off\n");
+        return;
+    }
+
+    printf("netconsole: %d.%d.%d.%d:%d (local port %d), UART output %s, %ld bytes dropped\n",
+            (int)(netconsole_ip >> 24 & 0xff),
+            (int)(netconsole_ip >> 16 & 0xff),
+            (int)(netconsole_ip >>  8 & 0xff),
+            (int)(netconsole_ip       & 0xff),
+            netconsole_port, NETCONSOLE_PORT,
+            netconsole_uart ? "on" : "off", netconsole_dropped);
+}
@@ -107,18 +107,55 @@ packet_t *packet_queue_pophead(packet_queue_t *q)
 }
 
 
+/* Packets come from a fixed pool of PACKET_MAXLEN buffers, allocated once
+ * at startup, so packet_alloc() and packet_free() are O(1). When the pool is
+ * exhausted packet_alloc() returns NULL and the caller drops the packet. */
+#define PACKET_BUFFER_SIZE ((sizeof(packet_t) + PACKET_MAXLEN + 3) & ~3)
+#define PACKET_POOL_SPARE 24    /* beyond the rx ring: tx window, queues etc */
+
+static packet_t *packet_pool_free_list = NULL;
+
+void packet_pool_init(void)
+{
+    uint8_t *buffers;
+    packet_t *p;
+
+    // allow for the contents of the card's receive ring to be queued twice over
+    // (once in sink queues, once in the TFTP disk write queue) plus spares;
+    // size for the largest ring eth_set_tx_slots() could give us later
+    packet_pool_size = 2 * (eth_rxbuffer_max_size() / PACKET_MAXLEN) + PACKET_POOL_SPARE;
+
+    buffers = malloc(packet_pool_size * PACKET_BUFFER_SIZE);
+    for(int i=0; i<packet_pool_size; i++){
+        p = (packet_t*)(buffers + i * PACKET_BUFFER_SIZE);
+        p->next = packet_pool_free_list;
+        packet_pool_free_list = p;
+    }
+}
+
 packet_t *packet_alloc(int data_size)
 {
-    if(data_size >= PACKET_MAXLEN)
+    packet_t *p;
+
+    if(data_size > PACKET_MAXLEN){
         printf("net: packet_alloc(%d): too big!\n", data_size);
+        return NULL;
+    }
+
+    p = packet_pool_free_list;
+    if(!p){
+        packet_pool_exhausted_count++;
+        return NULL;
+    }
+    packet_pool_free_list = p->next;
 
     packet_alive_count++;
-    if(packet_alive_count > 20)
-        printf("packet_alive_count=%ld\n", packet_alive_count);
+    if(packet_alive_count > packet_pool_high_water)
+        packet_pool_high_water = packet_alive_count;
 
-    packet_t *p=malloc(sizeof(packet_t) + data_size);
     memset(p, 0, sizeof(packet_t)); // do not zero out the data, just the header
-    p->buffer_length_alloc = p->buffer_length = data_size;
+    p->buffer_length_alloc = PACKET_MAXLEN;
+    p->buffer_length = data_size;
     p->eth = (ethernet_header_t*)p->buffer;
     return p;
 }
@@ -131,6 +168,9 @@ void packet_set_destination_mac(packet_t *packet, const macaddr_t *mac)
 
 void packet_free(packet_t *packet)
 {
-    free(packet);
+    if(packet->reassembly_buffer)
+        net_ipv4_reassembly_release(packet);
+    packet->next = packet_pool_free_list;
+    packet_pool_free_list = packet;
     packet_alive_count--;
 }
@@ -0,0 +1,477 @@
+/* (c) 2023 William R Sowerbutts <will@sowerbutts.com> */
+
+#include <types.h>
+#include <stdlib.h>
+#include <timers.h>
+#include <net.h>
+
+// documentation:
+// https://www.rfc-editor.org/rfc/rfc9293 - Transmission Control Protocol (TCP)
+// https://www.rfc-editor.org/rfc/rfc6298 - Computing TCP's Retransmission Timer
+// https://www.rfc-editor.org/rfc/rfc1122 - Requirements for Internet Hosts (delayed ACK)
+
+// A small TCP client: one connection at a time, active open only, no urgent
+// data, no out-of-order reassembly (the peer's fast retransmit covers the odd
+// lost segment on a LAN). We advertise a receive window the size of the
+// ethernet card's receive ring, since received data is consumed immediately.
+// TIME-WAIT is skipped: each connection uses a fresh local port instead.
+
+#undef TCP_DEBUG
+
+#define TX_BUFFER_SIZE  1024    // sent but not yet acknowledged, plus unsent
+#define RTO_INITIAL      500    // ms
+#define RTO_MAX         8000    // ms
+#define MAX_RETRIES        8
+#define DELAYED_ACK       40    // ms
+#define ACK_EVERY          2    // full-sized segments
+
+#define SEQ_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define SEQ_LE(a, b) ((int32_t)((a) - (b)) <= 0)
+
+typedef struct tcp_connection_t tcp_connection_t;
+
+struct tcp_connection_t {
+    packet_sink_t *sink;
+    tcp_state_t state;
+    bool reset;                   // connection was refused or reset
+    tcp_receive_cb_t cb_receive;
+    void *cb_private;
+
+    uint32_t snd_una;             // oldest unacknowledged sequence number
+    uint32_t snd_nxt;             // next sequence number to send
+    uint32_t snd_wnd;             // peer's receive window
+    uint16_t snd_mss;             // peer's maximum segment size
+    uint32_t tx_seq;              // sequence number of tx_buffer[0]
+    uint8_t tx_buffer[TX_BUFFER_SIZE];
+    int tx_length;
+    bool fin_queued;              // tcp_close() called; send FIN once data is out
+    bool fin_sent;
+
+    uint32_t rcv_nxt;             // next sequence number expected
+    uint16_t rcv_wnd;             // window we advertise
+    int segments_unacked;
+
+    int retries;
+    int rto;                      // ms
+    timer_t rto_timer;            // 0 when not running
+    timer_t ack_timer;            // 0 when no ACK is owed
+};
+
+static tcp_connection_t *tcp = NULL;
+
+static void tcp_schedule(void)
+{
+    timer_t t = tcp->rto_timer;
+    if(tcp->ack_timer && (!t || ((tcp->ack_timer - t) & 0x80000000)))
+        t = tcp->ack_timer;
+    tcp->sink->timer = t;
+}
+
+static void tcp_send_segment(uint8_t flags, uint32_t seq, const uint8_t *data, int length)
+{
+    int options = (flags & tcp_flag_syn) ? 4 : 0;
+    packet_t *packet = packet_create_tcp(tcp->sink->match_remote_ip, tcp->sink->match_remote_port,
+            tcp->sink->match_local_port, options + length);
+    if(!packet) // the retransmit timer will have another go
+        return;
+
+    packet->tcp->sequence = htonl(seq);
+    packet->tcp->flags = flags;
+    if(tcp->state != tcp_syn_sent){
+        packet->tcp->flags |= tcp_flag_ack;
+        packet->tcp->ack = htonl(tcp->rcv_nxt);
+    }else
+        packet->tcp->ack = 0;
+    packet->tcp->window_size = htons(tcp->rcv_wnd);
+
+    if(options){
+        // maximum segment size option
+        packet->data[0] = 2;
+        packet->data[1] = 4;
+        packet->data[2] = TCP_MSS >> 8;
+        packet->data[3] = TCP_MSS & 0xff;
+        packet->tcp->data_offset += (options / 4) << 4;
+        packet->data += options;
+        packet->data_length -= options;
+    }
+    if(length)
+        memcpy(packet->data, data, length);
+
+    // any ACK we owed goes with this segment
+    tcp->segments_unacked = 0;
+    tcp->ack_timer = 0;
+
+#ifdef TCP_DEBUG
+    printf("tcp: tx flags 0x%02x seq %lu len %d\n", flags, seq, length);
+#endif
+    net_tx(packet);
+}
+
+// send whatever the state, buffer and peer's window allow
+static void tcp_output(void)
+{
+    int offset, length;
+
+    switch(tcp->state){
+        case tcp_syn_sent:
+            if(tcp->snd_nxt == tcp->snd_una){
+                tcp_send_segment(tcp_flag_syn, tcp->snd_una, NULL, 0);
+                tcp->snd_nxt = tcp->snd_una + 1;
+            }
+            break;
+        case tcp_established:
+        case tcp_close_wait:
+        case tcp_fin_wait_1:
+        case tcp_closing:
+        case tcp_last_ack:
+            // data
+            offset = tcp->snd_nxt - tcp->tx_seq;
+            while(offset < tcp->tx_length){
+                length = tcp->tx_length - offset;
+                if(length > tcp->snd_mss)
+                    length = tcp->snd_mss;
+                if(tcp->snd_nxt + length - tcp->snd_una > tcp->snd_wnd)
+                    break; // peer has no room; wait for a window update
+                tcp_send_segment(tcp_flag_psh, tcp->snd_nxt, tcp->tx_buffer + offset, length);
+                tcp->snd_nxt += length;
+                offset += length;
+            }
+            // FIN once all data has been sent
+            if(tcp->fin_queued && !tcp->fin_sent && offset == tcp->tx_length){
+                tcp_send_segment(tcp_flag_fin, tcp->snd_nxt, NULL, 0);
+                tcp->snd_nxt++;
+                tcp->fin_sent = true;
+                if(tcp->state == tcp_established)
+                    tcp->state = tcp_fin_wait_1;
+                else if(tcp->state == tcp_close_wait)
+                    tcp->state = tcp_last_ack;
+            }
+            break;
+        default:
+            break;
+    }
+
+    // an ACK that could not wait for the delayed ACK timer
+    if(tcp->segments_unacked >= ACK_EVERY && tcp->state != tcp_closed)
+        tcp_send_segment(0, tcp->snd_nxt, NULL, 0);
+
+    if(tcp->snd_una != tcp->snd_nxt || (tcp->tx_length && tcp->state != tcp_closed)){
+        if(!tcp->rto_timer)
+            tcp->rto_timer = set_timer_ms(tcp->rto);
+    }else
+        tcp->rto_timer = 0;
+
+    tcp_schedule();
+}
+
+static void tcp_enter_closed(bool reset)
+{
+    tcp->state = tcp_closed;
+    tcp->reset = reset;
+    tcp->rto_timer = 0;
+    tcp->ack_timer = 0;
+    tcp_schedule();
+}
+
+static void tcp_send_reset(void)
+{
+    if(tcp->state != tcp_syn_sent && tcp->state != tcp_closed)
+        tcp_send_segment(tcp_flag_rst, tcp->snd_nxt, NULL, 0);
+}
+
+static void tcp_timer_expired(packet_sink_t *sink)
+{
+    if(tcp->ack_timer && timer_expired(tcp->ack_timer))
+        tcp_send_segment(0, tcp->snd_nxt, NULL, 0);
+
+    if(tcp->rto_timer && timer_expired(tcp->rto_timer)){
+        tcp->rto_timer = 0;
+        if(++tcp->retries > MAX_RETRIES){
+            printf("tcp: connection timed out\n");
+            tcp_send_reset();
+            tcp_enter_closed(true);
+            return;
+        }
+        // go back N: resend everything from the oldest unacknowledged byte
+        tcp->rto *= 2;
+        if(tcp->rto > RTO_MAX)
+            tcp->rto = RTO_MAX;
+        tcp->snd_nxt = tcp->snd_una;
+        if(tcp->fin_sent && tcp->snd_una != tcp->tx_seq + tcp->tx_length + 1)
+            tcp->fin_sent = false; // FIN not yet acknowledged
+    }
+
+    tcp_output();
+}
+
+static void tcp_parse_options(packet_t *packet)
+{
+    uint8_t *opt = packet->tcp->options, *end = packet->data;
+
+    while(opt < end && *opt != 0){ // 0 = end of options
+        if(*opt == 1){ // no-op
+            opt++;
+            continue;
+        }
+        if(opt + 1 >= end || opt[1] < 2)
+            break;
+        if(opt[0] == 2 && opt[1] == 4){ // maximum segment size
+            tcp->snd_mss = (opt[2] << 8) | opt[3];
+            if(tcp->snd_mss > TCP_MSS)
+                tcp->snd_mss = TCP_MSS;
+        }
+        opt += opt[1];
+    }
+}
+
+static void tcp_process_ack(uint32_t ack, uint16_t window)
+{
+    int acked;
+
+    if(SEQ_LE(ack, tcp->snd_una) || SEQ_LT(tcp->snd_nxt, ack)){
+        tcp->snd_wnd = window; // duplicate or bogus; window update only
+        return;
+    }
+
+    // drop acknowledged data from the buffer
+    acked = ack - tcp->tx_seq;
+    if(acked > tcp->tx_length)
+        acked = tcp->tx_length; // our FIN was acknowledged too
+    if(acked > 0){
+        memmove(tcp->tx_buffer, tcp->tx_buffer + acked, tcp->tx_length - acked);
+        tcp->tx_length -= acked;
+        tcp->tx_seq += acked;
+    }
+
+    tcp->snd_una = ack;
+    tcp->snd_wnd = window;
+    tcp->retries = 0;
+    tcp->rto = RTO_INITIAL;
+    tcp->rto_timer = 0; // tcp_output() restarts it if anything is still outstanding
+
+    if(tcp->fin_sent && ack == tcp->snd_nxt){ // our FIN is acknowledged
+        switch(tcp->state){
+            case tcp_fin_wait_1:
+                tcp->state = tcp_fin_wait_2;
+                break;
+            case tcp_closing:
+            case tcp_last_ack:
+                tcp_enter_closed(false);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void tcp_packet_received(packet_sink_t *sink, packet_t *packet)
+{
+    uint8_t flags = packet->tcp->flags;
+    uint32_t seq = ntohl(packet->tcp->sequence);
+    uint32_t ack = ntohl(packet->tcp->ack);
+    uint16_t window = ntohs(packet->tcp->window_size);
+
+#ifdef TCP_DEBUG
+    printf("tcp: rx flags 0x%02x seq %lu ack %lu len %d\n", flags, seq, ack, packet->data_length);
+#endif
+
+    if(tcp->state == tcp_closed)
+        goto done;
+
+    if(tcp->state == tcp_syn_sent){
+        if((flags & tcp_flag_ack) && ack != tcp->snd_nxt)
+            goto done; // not for this connection
+        if(flags & tcp_flag_rst){
+            if(flags & tcp_flag_ack)
+                tcp_enter_closed(true); // connection refused
+            goto done;
+        }
+        if((flags & (tcp_flag_syn | tcp_flag_ack)) != (tcp_flag_syn | tcp_flag_ack))
+            goto done; // we don't do simultaneous open
+        tcp->rcv_nxt = seq + 1;
+        tcp_parse_options(packet);
+        tcp->state = tcp_established;
+        tcp_process_ack(ack, window);
+        tcp->segments_unacked = ACK_EVERY; // ACK the SYN now
+        tcp_output();
+        goto done;
+    }
+
+    // only accept segments starting exactly where we expect
+    if(seq != tcp->rcv_nxt){
+        if(packet->data_length || (flags & (tcp_flag_syn | tcp_flag_fin))){
+            // duplicate or out of order: a prompt duplicate ACK helps the peer recover
+            tcp->segments_unacked = ACK_EVERY;
+            tcp_output();
+        }
+        goto done;
+    }
+
+    if(flags & tcp_flag_rst){
+        tcp_enter_closed(true);
+        goto done;
+    }
+
+    if(flags & tcp_flag_ack)
+        tcp_process_ack(ack, window);
+    if(tcp->state == tcp_closed)
+        goto done;
+
+    if(packet->data_length){
+        switch(tcp->state){
+            case tcp_established:
+            case tcp_fin_wait_1:
+            case tcp_fin_wait_2:
+                if(tcp->cb_receive && !tcp->cb_receive(tcp->cb_private, packet->data, packet->data_length)){
+                    tcp_send_reset();
+                    tcp_enter_closed(true);
+                    goto done;
+                }
+                tcp->rcv_nxt += packet->data_length;
+                tcp->segments_unacked++;
+                if(!tcp->ack_timer)
+                    tcp->ack_timer = set_timer_ms(DELAYED_ACK);
+                break;
+            default: // peer already sent FIN
+                break;
+        }
+    }
+
+    if(flags & tcp_flag_fin){
+        tcp->rcv_nxt++;
+        tcp->segments_unacked = ACK_EVERY; // ACK the FIN now
+        switch(tcp->state){
+            case tcp_established:
+                tcp->state = tcp_close_wait;
+                break;
+            case tcp_fin_wait_1:
+                tcp->state = tcp_closing;
+                break;
+            case tcp_fin_wait_2:
+                tcp_send_segment(0, tcp->snd_nxt, NULL, 0);
+                tcp_enter_closed(false);
+                goto done;
+            default:
+                break;
+        }
+    }
+
+    tcp_output();
+
+done:
+    packet_free(packet);
+}
+
+bool tcp_connect(uint32_t remote_ip, uint16_t remote_port, tcp_receive_cb_t cb_receive, void *cb_private)
+{
+    int frames;
+
+    if(tcp && tcp->state != tcp_closed){
+        printf("tcp: connection already in use\n");
+        return false;
+    }
+
+    if(!tcp){
+        tcp = malloc(sizeof(tcp_connection_t));
+        tcp->sink = NULL;
+    }
+    if(tcp->sink){
+        net_remove_packet_sink(tcp->sink);
+        packet_sink_free(tcp->sink);
+    }
+
+    memset(tcp, 0, sizeof(tcp_connection_t));
+    tcp->cb_receive = cb_receive;
+    tcp->cb_private = cb_private;
+    tcp->snd_una = tcp->snd_nxt = gogoboot_read_timer() << 12; // initial sequence number
+    tcp->tx_seq = tcp->snd_una + 1; // data follows the SYN
+    tcp->snd_mss = 536; // RFC 9293 default, until the peer tells us otherwise
+    tcp->rto = RTO_INITIAL;
+    tcp->state = tcp_syn_sent;
+
+    // advertise what the card's receive ring can hold without overflowing
+    frames = (eth_rxbuffer_size() - 256) / (256 * 6);
+    if(frames < 1)
+        frames = 1;
+    tcp->rcv_wnd = (frames * TCP_MSS > 0xffff) ? 0xffff : frames * TCP_MSS;
+
+    tcp->sink = packet_sink_alloc();
+    tcp->sink->match_ethertype = ethertype_ipv4;
+    tcp->sink->match_ipv4_protocol = ip_proto_tcp;
+    tcp->sink->match_interface_local_ip = true;
+    tcp->sink->match_local_port = 8192 + (gogoboot_read_timer() & 0x7fff);
+    tcp->sink->match_remote_ip = remote_ip;
+    tcp->sink->match_remote_port = remote_port;
+    tcp->sink->cb_packet_received = tcp_packet_received;
+    tcp->sink->cb_timer_expired = tcp_timer_expired;
+    net_add_packet_sink(tcp->sink);
+
+    tcp_output();
+
+    return true;
+}
+
+int tcp_send(const void *data, int length)
+{
+    if(!tcp || tcp->fin_queued ||
+       (tcp->state != tcp_syn_sent && tcp->state != tcp_established && tcp->state != tcp_close_wait))
+        return -1;
+
+    if(length > TX_BUFFER_SIZE - tcp->tx_length)
+        length = TX_BUFFER_SIZE - tcp->tx_length;
+    memcpy(tcp->tx_buffer + tcp->tx_length, data, length);
+    tcp->tx_length += length;
+
+    if(tcp->state != tcp_syn_sent)
+        tcp_output();
+
+    return length;
+}
+
+void tcp_close(void)
+{
+    if(!tcp || tcp->state == tcp_closed)
+        return;
+
+    if(tcp->state == tcp_syn_sent){
+        tcp_enter_closed(false);
+        return;
+    }
+
+    tcp->fin_queued = true;
+    tcp_output();
+}
+
+void tcp_abort(void)
+{
+    if(!tcp || tcp->state == tcp_closed)
+        return;
+
+    tcp_send_reset();
+    tcp_enter_closed(true);
+}
+
+tcp_state_t tcp_state(void)
+{
+    return tcp ? tcp->state : tcp_closed;
+}
+
+bool tcp_was_reset(void)
+{
+    return tcp && tcp->reset;
+}
+
+bool tcp_peer_closed(void)
+{
+    if(!tcp)
+        return true;
+    switch(tcp->state){
+        case tcp_close_wait:
+        case tcp_closing:
+        case tcp_last_ack:
+        case tcp_closed:
+            return true;
+        default:
+            return false;
+    }
+}
@@ -3,11 +3,15 @@
 #include <uart.h>
 #include <timers.h>
 #include <fatfs/ff.h>
+#include <disk.h>
 #include <cli.h>
+#include <init.h>
 #include <net.h>
+#include <task.h>
 
 // documentation:
 // https://www.rfc-editor.org/rfc/rfc1350 - TFTP Protocol (Revision 2)
+// https://www.rfc-editor.org/rfc/rfc2090 - TFTP Multicast Option
 // https://www.rfc-editor.org/rfc/rfc2347 - TFTP Option Extension
 // https://www.rfc-editor.org/rfc/rfc2349 - TFTP Timeout Interval and Transfer Size Options
 // https://www.rfc-editor.org/rfc/rfc7440 - TFTP Windowsize Option
@@ -16,6 +20,16 @@
 #define REQUEST_TIMEOUT 1500 // ms
 #define DATA_TIMEOUT     250 // ms
 
+#define BLOCK_SIZE (UDP_MAX_PAYLOAD - 4) // 1468: largest TFTP data block that fits in one ethernet frame
+#define LARGE_BLOCK_SIZE 8192            // gets: blocks spanning several frames, with IPv4 reassembly
+#define FRAGMENT_PAYLOAD (ETHERNET_MTU - sizeof(ipv4_header_t)) // 1480
+#define DISK_STAGE_MIN  (16 * FF_MAX_SS) // received data is written to disk in whole clusters, at least this much
+#define DISK_STAGE_MAX  (64 * 1024)      // ... and at most this much, for volumes with huge clusters
+#define PUT_READ_AHEAD  (16 * FF_MAX_SS) // least data read from disk at once when sending
+
+#define WINDOW_MAX        16 // largest windowsize we will ever request
+#define WINDOW_HISTORY     8 // number of servers we remember
+
 typedef struct tftp_transfer_t tftp_transfer_t;
 
 struct tftp_transfer_t {
@@ -24,20 +38,62 @@ struct tftp_transfer_t {
     bool is_put;
     char *tftp_filename;
     char *disk_filename;
+    tftp_receive_cb_t cb_receive; // when set, received data goes here rather than disk_file
+    tftp_locate_cb_t cb_locate;   // optional, with cb_receive: lets the driver receive data in place
+    void *cb_private;
+    bool is_memory;               // data is sent from/received to mem_buffer rather than disk_file
+    uint8_t *mem_buffer;          // may legitimately be address 0
+    uint32_t mem_length;          // size of mem_buffer
+    uint8_t *disk_stage;          // coalesces received blocks into cluster-aligned disk writes
+    int disk_stage_used;
+    int disk_stage_size;          // a whole number of clusters
+    uint32_t disk_writes_mark;    // disk_write_calls when the transfer started
+    uint32_t disk_sectors_mark;
+    uint32_t disk_stage_offset;   // file offset of disk_stage[0]
+    uint8_t *put_cache;           // put from disk: file data from around the window start, read ahead
+    uint32_t put_cache_offset;    // file offset of put_cache[0]
+    int put_cache_used;
+    int put_cache_size;
+    bool put_cache_eof;           // put_cache runs to the end of the file
     uint16_t block_size;
+    uint16_t requested_block_size; // blksize we asked for; the OACK may only lower it
     uint16_t last_block;
     uint16_t last_ack;
     uint16_t rollover_value;
     int bytes_transferred;
     int total_size;
     int window_size;
+    int blocks_sent;              // put: blocks sent in the current window
+    int windows;                  // windows completed
+    int lossy_windows;            // windows which saw a timeout or ethernet overflow
+    bool window_lossy;            // current window has seen loss
+    bool ring_shared;             // window cut to share the card with other gets; don't learn from it
+    uint32_t overflow_mark;       // eth_overflow_count() when last checked
     bool started;
     bool completed;
+    timer_t start_time;
+    int reported_transferred;     // bytes_transferred at the last progress report
     bool success;
     int timeouts;
     int retransmits_this_block;
+    bool oack_pending;            // server: OACK sent, waiting for the client's ACK of block 0
+    uint8_t server_options;       // server: options accepted from the client (SERVER_OPT_*)
+    bool multicast;               // get: ask the server for a multicast transfer (RFC 2090)
+    bool mc_master;               // multicast: the server expects our ACKs
+    uint32_t mc_group;            // multicast: group joined, or 0
+    uint16_t mc_port;
+    packet_sink_t *mc_sink;       // multicast: receives DATA sent to the group
+    uint8_t *mc_bitmap;           // multicast: blocks received, bit n for block n+1
+    int mc_blocks;                // multicast: blocks in the file
+    int mc_received;              // multicast: blocks received so far
+    int mc_next;                  // multicast: first block missing, counting from 0
 };
 
+#define SERVER_OPT_BLKSIZE     1
+#define SERVER_OPT_WINDOWSIZE  2
+#define SERVER_OPT_TSIZE       4
+#define SERVER_OPT_ROLLOVER    8
+
 typedef struct tftp_header_t tftp_header_t;
 
 struct __attribute__((packed, aligned(2))) tftp_header_t {
@@ -58,6 +114,25 @@ struct __attribute__((packed, aligned(2))) tftp_header_t {
     } payload;
 };
 
+/* RFC 7440 fixes the windowsize for the lifetime of a transfer, so we adapt
+ * it between transfers instead: each server's window grows after transfers
+ * that ran cleanly and is halved after transfers that saw loss. Below the
+ * threshold the window doubles, above it grows by one (like TCP slow start
+ * and congestion avoidance). */
+typedef struct tftp_window_history_t tftp_window_history_t;
+
+struct tftp_window_history_t {
+    uint32_t server_ip;
+    uint8_t window[2];    // indexed by is_put
+    uint8_t threshold[2];
+};
+
+static tftp_window_history_t window_history[WINDOW_HISTORY];
+static int window_history_next = 0;
+
+static int tftp_client_gets = 0;      // client transfers receiving data; they share the card's ring
+static uint16_t tftp_next_port = 0;   // local port for the next client transfer
+
 static const uint16_t tftp_op_rrq = 1;
 static const uint16_t tftp_op_wrq = 2;
 static const uint16_t tftp_op_data = 3;
@@ -80,6 +155,137 @@ static uint16_t expected_block_number(tftp_transfer_t *tftp, int count)
     return expected_block;
 }
 
+static int window_limit(bool is_put)
+{
+    int limit;
+
+    /* when receiving, try to avoid overflowing ethernet device receive buffer */
+    /* no issue on transmit path */
+    /* 6 * 256 = 1536 bytes; allows 1468 byte payload + headers + 4 byte ring header */
+    /* the card always keeps one page free between its read and write pointers */
+    if(is_put)
+        limit = WINDOW_MAX;
+    else
+        limit = (eth_rxbuffer_size() - 256) / (256 * 6);
+
+    if(limit > WINDOW_MAX)
+        limit = WINDOW_MAX;
+    if(limit < 1) /* need at least 1 */
+        limit = 1;
+
+    return limit;
+}
+
+// frames one receiving transfer may have in flight: concurrent gets split the ring
+static int window_share(void)
+{
+    int limit = window_limit(false);
+
+    if(tftp_client_gets > 1)
+        limit /= tftp_client_gets;
+
+    return limit < 1 ? 1 : limit;
+}
+
+// window sizes are remembered in frames, which is what the card has to hold
+static int frames_per_block(int block_size)
+{
+    return (block_size + 4 + sizeof(udp_header_t) + FRAGMENT_PAYLOAD - 1) / FRAGMENT_PAYLOAD;
+}
+
+// the block size we ask for. larger blocks mean fewer ACK round trips for
+// servers without windowsize, but all the fragments of a block must fit
+// into the card's receive ring at once, and we only reassemble, not fragment.
+// gets to memory stay in single frames: fragments cannot be steered, and the
+// copies through the reassembly buffer cost more than the ACKs they save.
+static int request_block_size(tftp_transfer_t *tftp)
+{
+    int size = net_ipv4_reassembly_max() - sizeof(udp_header_t) - 4;
+
+    if(tftp->is_put || tftp->is_memory || tftp->cb_locate || size <= BLOCK_SIZE)
+        return BLOCK_SIZE;
+    if(size > LARGE_BLOCK_SIZE)
+        size = LARGE_BLOCK_SIZE;
+    if(frames_per_block(size) > window_share())
+        return BLOCK_SIZE;
+
+    return size;
+}
+
+static tftp_window_history_t *window_history_lookup(uint32_t server_ip)
+{
+    tftp_window_history_t *h;
+
+    for(int i=0; i<WINDOW_HISTORY; i++)
+        if(window_history[i].server_ip == server_ip)
+            return &window_history[i];
+
+    // new server: replace the oldest entry; start at half our limit
+    h = &window_history[window_history_next];
+    window_history_next = (window_history_next + 1) % WINDOW_HISTORY;
+    h->server_ip = server_ip;
+    for(int i=0; i<2; i++){
+        h->window[i] = (window_limit(i) + 1) / 2;
+        h->threshold[i] = window_limit(i);
+    }
+
+    return h;
+}
+
+static void window_check_overflow(tftp_transfer_t *tftp)
+{
+    uint32_t overflows = eth_overflow_count();
+
+    if(overflows != tftp->overflow_mark){
+        tftp->overflow_mark = overflows;
+        tftp->window_lossy = true;
+    }
+}
+
+static void window_completed(tftp_transfer_t *tftp)
+{
+    window_check_overflow(tftp);
+    tftp->windows++;
+    if(tftp->window_lossy)
+        tftp->lossy_windows++;
+    tftp->window_lossy = false;
+}
+
+static void window_history_update(packet_sink_t *sink)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+    tftp_window_history_t *h = window_history_lookup(sink->match_remote_ip);
+    int window = h->window[tftp->is_put];
+    int limit = window_limit(tftp->is_put);
+    int frames = tftp->window_size * frames_per_block(tftp->block_size);
+
+    window_check_overflow(tftp);
+    if(tftp->window_lossy)
+        tftp->lossy_windows++;
+
+    if(tftp->lossy_windows * 32 > tftp->windows){
+        // more than ~3% of windows saw loss: back off
+        window = (frames + 1) / 2;
+        h->threshold[tftp->is_put] = window;
+    }else if(tftp->lossy_windows == 0 && tftp->windows >= 4 && frames >= window){
+        // clean transfer at the full window: grow
+        if(window < h->threshold[tftp->is_put])
+            window *= 2;
+        else
+            window++;
+    }
+
+    if(window > limit)
+        window = limit;
+    if(window < 1)
+        window = 1;
+
+    if(window != h->window[tftp->is_put])
+        printf("tftp: windowsize %d -> %d for next transfer (%d/%d windows lossy)\n",
+                h->window[tftp->is_put], window, tftp->lossy_windows, tftp->windows);
+    h->window[tftp->is_put] = window;
+}
+
 #define MAXOPT 1400
 static int options_append(char *options, int offset, char *extra)
 {
@@ -94,30 +300,40 @@ static int options_append(char *options, int offset, char *extra)
     return offset + extra_len;
 }
 
+static int options_append_number(char *options, int offset, uint32_t n)
+{
+    char numbuf[12];
+    char *t = numbuf+sizeof(numbuf);
+
+    *--t = 0;
+    do {
+        *--t = (n % 10)+'0';
+        n/=10;
+    } while(n);
+
+    return options_append(options, offset, t);
+}
+
 static packet_t *tftp_create_request(packet_sink_t *sink)
 {
     tftp_transfer_t *tftp = sink->sink_private;
     char options[MAXOPT];
     int offset = 0;
-    int windowsize;
-    char wsize[2];
-
-    /* when receiving, try to avoid overflowing ethernet device receive buffer */
-    /* no issue on transmit path */
-    /* 5 * 256 = 1280 bytes; allows 1024 byte payload + up to 210 headers etc */
-    if(tftp->is_put)
-        windowsize = 8;
-    else
-        windowsize = eth_rxbuffer_size() / (256 * 5); 
-
-    if(windowsize > 8) /* 8 works really well */
-        windowsize = 8;
-    if(windowsize < 1) /* need at least 1 */
+    int windowsize, block_size;
+
+    windowsize = window_history_lookup(sink->match_remote_ip)->window[tftp->is_put];
+    if(windowsize > window_limit(tftp->is_put)) /* eg card changed */
+        windowsize = window_limit(tftp->is_put);
+    if(!tftp->is_put && windowsize > window_share()){ /* other gets in progress */
+        windowsize = window_share();
+        tftp->ring_shared = true;
+    }
+    block_size = request_block_size(tftp);
+    tftp->requested_block_size = block_size;
+    windowsize /= frames_per_block(block_size);
+    if(windowsize < 1)
         windowsize = 1;
 
-    wsize[0] = '0' + windowsize;
-    wsize[1] = 0;
-
     offset = options_append(options, offset, tftp->tftp_filename);
     offset = options_append(options, offset, "octet");
 
@@ -126,27 +342,28 @@ static packet_t *tftp_create_request(packet_sink_t *sink)
 
     offset = options_append(options, offset, "tsize");
     if(tftp->is_put){
-        uint32_t n = tftp->total_size;
-        char sizebuf[12];
-        char *t = sizebuf+sizeof(sizebuf);  
-        *--t = 0; 
-        do { 
-            *--t = (n % 10)+'0'; 
-            n/=10; 
-        } while(n);
-        offset = options_append(options, offset, t);
+        offset = options_append_number(options, offset, tftp->total_size);
     }else{
         /* get request: 0 = please tell me total file size */
         offset = options_append(options, offset, "0");
     }
 
     offset = options_append(options, offset, "blksize");
-    offset = options_append(options, offset, "1024");
+    offset = options_append_number(options, offset, block_size);
 
-    offset = options_append(options, offset, "windowsize");
-    offset = options_append(options, offset, wsize);
+    if(tftp->multicast){
+        // RFC 2090 has the master client ACK one block at a time; a
+        // window does not combine with it
+        offset = options_append(options, offset, "multicast");
+        offset = options_append(options, offset, "");
+    }else{
+        offset = options_append(options, offset, "windowsize");
+        offset = options_append_number(options, offset, windowsize);
+    }
 
     packet_t *packet = packet_create_for_sink(sink, offset + 2);
+    if(!packet)
+        return NULL;
     packet->udp->destination_port = htons(69); // RRQ/WRQ always goes to server port 69
     tftp_header_t *message = (tftp_header_t*)packet->data;
     message->opcode = htons(tftp->is_put ? tftp_op_wrq : tftp_op_rrq);
@@ -160,6 +377,8 @@ static packet_t *tftp_create_ack(packet_sink_t *sink)
     tftp_transfer_t *tftp = sink->sink_private;
 
     packet_t *packet = packet_create_for_sink(sink, 4);
+    if(!packet)
+        return NULL;
     tftp_header_t *message = (tftp_header_t*)packet->data;
 
     message->opcode = htons(tftp_op_ack);
@@ -174,6 +393,8 @@ static packet_t *tftp_create_data(packet_sink_t *sink, uint16_t block_number)
     tftp_transfer_t *tftp = sink->sink_private;
 
     packet_t *packet = packet_create_for_sink(sink, tftp->block_size + 4);
+    if(!packet)
+        return NULL;
     tftp_header_t *message = (tftp_header_t*)packet->data;
 
     message->opcode = htons(tftp_op_data);
@@ -182,28 +403,134 @@ static packet_t *tftp_create_data(packet_sink_t *sink, uint16_t block_number)
     return packet;
 }
 
+static packet_t *tftp_create_error(packet_sink_t *sink, uint16_t error_code, const char *error_message)
+{
+    int len = strlen(error_message) + 1;
+
+    packet_t *packet = packet_create_for_sink(sink, len + 4);
+    if(!packet)
+        return NULL;
+    tftp_header_t *message = (tftp_header_t*)packet->data;
+
+    message->opcode = htons(tftp_op_err);
+    message->payload.error.error_code = htons(error_code);
+    memcpy(message->payload.error.error_message, error_message, len);
+
+    return packet;
+}
+
+// server: acknowledge the options we accepted from an RRQ
+static packet_t *tftp_create_options_ack(packet_sink_t *sink)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+    char options[MAXOPT];
+    int offset = 0;
+
+    if(tftp->server_options & SERVER_OPT_BLKSIZE){
+        offset = options_append(options, offset, "blksize");
+        offset = options_append_number(options, offset, tftp->block_size);
+    }
+    if(tftp->server_options & SERVER_OPT_WINDOWSIZE){
+        offset = options_append(options, offset, "windowsize");
+        offset = options_append_number(options, offset, tftp->window_size);
+    }
+    if(tftp->server_options & SERVER_OPT_TSIZE){
+        offset = options_append(options, offset, "tsize");
+        offset = options_append_number(options, offset, tftp->total_size);
+    }
+    if(tftp->server_options & SERVER_OPT_ROLLOVER){
+        offset = options_append(options, offset, "rollover");
+        offset = options_append_number(options, offset, tftp->rollover_value);
+    }
+
+    packet_t *packet = packet_create_for_sink(sink, offset + 2);
+    if(!packet)
+        return NULL;
+    tftp_header_t *message = (tftp_header_t*)packet->data;
+    message->opcode = htons(tftp_op_options_ack);
+    memcpy(message->payload.raw, options, offset);
+
+    return packet;
+}
+
+/* Sending from disk goes through put_cache: the file is read sequentially
+ * in large multi-sector chunks, and blocks stay in memory until the
+ * receiver has acknowledged them, so retransmits never touch the disk.
+ * Reads are kept sector aligned by discarding acknowledged data only in
+ * whole sectors. */
+static bool tftp_put_cache_fill(tftp_transfer_t *tftp, uint32_t end)
+{
+    FRESULT fr;
+    UINT size;
+    uint32_t discard;
+
+    if(tftp->put_cache_eof || end <= tftp->put_cache_offset + tftp->put_cache_used)
+        return true;
+
+    if(!tftp->put_cache){
+        // the whole window, plus the part sector before it
+        tftp->put_cache_size = tftp->window_size * tftp->block_size + FF_MAX_SS;
+        if(tftp->put_cache_size < PUT_READ_AHEAD)
+            tftp->put_cache_size = PUT_READ_AHEAD;
+        tftp->put_cache_size = (tftp->put_cache_size + FF_MAX_SS - 1) & ~(FF_MAX_SS - 1);
+        tftp->put_cache = malloc(tftp->put_cache_size);
+    }
+
+    discard = (tftp->bytes_transferred & ~(FF_MAX_SS - 1)) - tftp->put_cache_offset;
+    if(discard > 0){
+        tftp->put_cache_used -= discard;
+        memmove(tftp->put_cache, tftp->put_cache + discard, tftp->put_cache_used);
+        tftp->put_cache_offset += discard;
+    }
+
+    fr = f_read(&tftp->disk_file, tftp->put_cache + tftp->put_cache_used,
+            tftp->put_cache_size - tftp->put_cache_used, &size);
+    if(fr != FR_OK){
+        printf("tftp: failed to read from \"%s\": %s\n", tftp->disk_filename, f_errmsg(fr));
+        return false;
+    }
+    if(size < tftp->put_cache_size - tftp->put_cache_used)
+        tftp->put_cache_eof = true;
+    tftp->put_cache_used += size;
+
+    return true;
+}
+
 static void tftp_put_send_data(packet_sink_t *sink, int count)
 {
     tftp_transfer_t *tftp = sink->sink_private;
     bool last_block = false;
     packet_t *packet;
     tftp_header_t *message;
-    FRESULT fr;
-    UINT size;
+    uint8_t *source;
+    uint32_t offset, source_offset, source_end, size;
 
-    f_lseek(&tftp->disk_file, tftp->bytes_transferred);
-
-    for(int n=0; !last_block && n < count; n++){
-        packet = tftp_create_data(sink, expected_block_number(tftp, n + 1));
-        message = (tftp_header_t*)packet->data;
-        fr = f_read(&tftp->disk_file, message->payload.data.data, tftp->block_size, &size);
-        if(fr != FR_OK){
-            printf("tftp: failed to read from \"%s\": %s\n", tftp->disk_filename, f_errmsg(fr));
+    if(tftp->is_memory){
+        source = tftp->mem_buffer;
+        source_offset = 0;
+        source_end = tftp->mem_length;
+    }else{
+        if(!tftp_put_cache_fill(tftp, tftp->bytes_transferred + count * tftp->block_size)){
             tftp->completed = true;
             tftp->success = false;
-            packet_free(packet);
             return;
         }
+        source = tftp->put_cache;
+        source_offset = tftp->put_cache_offset;
+        source_end = tftp->put_cache_offset + tftp->put_cache_used;
+    }
+
+    tftp->blocks_sent = 0;
+    for(int n=0; !last_block && n < count; n++){
+        packet = tftp_create_data(sink, expected_block_number(tftp, n + 1));
+        if(!packet) // out of buffers; the rest of the window goes after the next ACK or timeout
+            break;
+        message = (tftp_header_t*)packet->data;
+        offset = tftp->bytes_transferred + n * tftp->block_size;
+        size = (offset < source_end) ? source_end - offset : 0;
+        if(size > tftp->block_size)
+            size = tftp->block_size;
+        memcpy(message->payload.data.data, source + offset - source_offset, size);
         if(size < tftp->block_size){
             if(!packet_data_resize(packet, size + 4)){
                 printf("tftp: resize failed\n");
@@ -213,6 +540,7 @@ static void tftp_put_send_data(packet_sink_t *sink, int count)
             last_block = true;
         }
         net_tx(packet);
+        tftp->blocks_sent = n + 1;
     }
 
     sink->timer = set_timer_ms(DATA_TIMEOUT);
@@ -243,13 +571,18 @@ static void tftp_put_process_ack(packet_sink_t *sink, packet_t *packet)
     tftp->last_block = block;
     tftp->bytes_transferred += ((int)tftp->block_size * (int)blocks_transferred);
 
+    if(blocks_transferred < tftp->blocks_sent && tftp->bytes_transferred <= tftp->total_size)
+        tftp->window_lossy = true; // server saw a gap
+    if(blocks_transferred > 0)
+        window_completed(tftp);
+
     if(tftp->bytes_transferred > tftp->total_size){ /* note > is correct here */
         // we're done!
         tftp->completed = true;
         tftp->success = true;
     }else{
         // send more
-        tftp_put_send_data(sink, (blocks_transferred == tftp->window_size) ? tftp->window_size : 1);
+        tftp_put_send_data(sink, (blocks_transferred == tftp->blocks_sent) ? tftp->window_size : 1);
     }
 }
 
@@ -259,11 +592,95 @@ static void tftp_get_send_ack(packet_sink_t *sink)
     sink->timer = set_timer_ms(DATA_TIMEOUT);
 }
 
+static void tftp_client_packet_received(packet_sink_t *sink, packet_t *packet);
+
+// parse the RFC 2090 "multicast" option value "address,port,mc"; the address
+// and port may be left out of OACKs after the first one
+static bool tftp_multicast_option(tftp_transfer_t *tftp, char *val)
+{
+    char *port, *mc;
+    uint32_t group;
+
+    port = strchr(val, ',');
+    if(!port)
+        return false;
+    *port++ = 0;
+    mc = strchr(port, ',');
+    if(!mc)
+        return false;
+    *mc++ = 0;
+
+    if(*val){
+        group = net_parse_ipv4(val);
+        if(!ipv4_is_multicast(group))
+            return false;
+        if(tftp->mc_group && group != tftp->mc_group)
+            return false; // the server may not move us to another group
+        tftp->mc_group = group;
+    }
+    if(*port)
+        tftp->mc_port = atoi(port);
+    tftp->mc_master = (atoi(mc) == 1);
+
+    return tftp->mc_group && tftp->mc_port;
+}
+
+static void tftp_multicast_packet_received(packet_sink_t *mc_sink, packet_t *packet)
+{
+    tftp_client_packet_received(mc_sink->sink_private, packet);
+}
+
+// join the group and start listening; blocks may now arrive in any order
+static bool tftp_multicast_start(packet_sink_t *sink)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+    packet_sink_t *mc_sink;
+    uint32_t group = tftp->mc_group;
+
+    tftp->mc_group = 0; // until we have joined
+    if(!net_multicast_join(group))
+        return false;
+    tftp->mc_group = group;
+
+    tftp->mc_blocks = tftp->total_size / tftp->block_size + 1; // the final block is short, perhaps empty
+    tftp->mc_bitmap = malloc((tftp->mc_blocks + 7) / 8);
+    memset(tftp->mc_bitmap, 0, (tftp->mc_blocks + 7) / 8);
+
+    mc_sink = packet_sink_alloc();
+    mc_sink->match_local_ip = group;
+    mc_sink->match_ipv4_protocol = ip_proto_udp;
+    mc_sink->match_local_port = tftp->mc_port;
+    mc_sink->match_remote_ip = sink->match_remote_ip;
+    mc_sink->match_remote_port = sink->match_remote_port;
+    mc_sink->sink_private = sink;
+    mc_sink->cb_packet_received = tftp_multicast_packet_received;
+    net_add_packet_sink(mc_sink);
+    tftp->mc_sink = mc_sink;
+
+    printf("tftp: multicast group %d.%d.%d.%d port %d, %d blocks\n",
+            (int)(group >> 24 & 0xff), (int)(group >> 16 & 0xff),
+            (int)(group >>  8 & 0xff), (int)(group       & 0xff),
+            tftp->mc_port, tftp->mc_blocks);
+
+    return true;
+}
+
+static void tftp_multicast_wait(packet_sink_t *sink)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+
+    if(tftp->mc_master || tftp->completed)
+        tftp_get_send_ack(sink);
+    else
+        sink->timer = set_timer_ms(REQUEST_TIMEOUT); // listen; ask again if the group goes quiet
+}
+
 static void tftp_process_options_ack(packet_sink_t *sink, tftp_header_t *message, int message_len)
 {
     tftp_transfer_t *tftp = sink->sink_private;
     char *opt, *val, *ptr, *end;
     int val_int;
+    bool tsize_known = false, multicast = false;
 
     // message->opcode has been confirmed to be tftp_op_options_ack already
 
@@ -287,6 +704,7 @@ static void tftp_process_options_ack(packet_sink_t *sink, tftp_header_t *message
         if(ptr >= end)
             break;
         ptr++;
+        printf(" %s=%s", opt, val);
         // process option + value
         val_int = atoi(val);
         if(!strcmp(opt, "rollover") && (val_int == 0 || val_int == 1)){
@@ -294,16 +712,51 @@ static void tftp_process_options_ack(packet_sink_t *sink, tftp_header_t *message
         }else if(!strcmp(opt, "tsize")){
             if(!tftp->is_put)
                 tftp->total_size = val_int;
+            tsize_known = true;
         }else if(!strcmp(opt, "blksize")){
-            tftp->block_size = val_int;
+            if(val_int >= 8 && val_int <= tftp->requested_block_size && !tftp->mc_bitmap) // server may only reduce it
+                tftp->block_size = val_int;
         }else if(!strcmp(opt, "windowsize")){
             tftp->window_size = val_int;
+        }else if(!strcmp(opt, "multicast") && tftp->multicast){
+            multicast = tftp_multicast_option(tftp, val);
         }
-        printf(" %s=%d", opt, val_int);
     }
 
     putchar('\n');
 
+    if(tftp->mc_bitmap){
+        // a later OACK, telling us whether we are now the master client
+        if(tftp->mc_master)
+            printf("tftp: now the master client\n");
+        tftp_multicast_wait(sink);
+        return;
+    }
+
+    if(!tftp->is_put && tftp->is_memory && tftp->total_size > tftp->mem_length){
+        printf("tftp: file too large for memory (%d bytes, 0x%lx available)\n", tftp->total_size, tftp->mem_length);
+        net_tx(tftp_create_error(sink, 3, "Disk full or allocation exceeded"));
+        tftp->completed = true;
+        tftp->success = false;
+        return;
+    }
+
+    if(tftp->multicast && !multicast)
+        printf("tftp: server did not offer multicast; continuing by unicast\n");
+
+    if(multicast){
+        // we need to know how many blocks to expect
+        if(!tsize_known || !tftp_multicast_start(sink)){
+            printf("tftp: cannot take part in the multicast transfer\n");
+            net_tx(tftp_create_error(sink, 8, "Multicast transfer failed"));
+            tftp->completed = true;
+            tftp->success = false;
+            return;
+        }
+        tftp_multicast_wait(sink);
+        return;
+    }
+
     if(tftp->is_put){
         // for sending files, send our first DATA packets to agree to the options
         tftp_put_send_data(sink, tftp->window_size);
@@ -313,13 +766,83 @@ static void tftp_process_options_ack(packet_sink_t *sink, tftp_header_t *message
     }
 }
 
+static bool tftp_disk_stage_flush(tftp_transfer_t *tftp)
+{
+    FRESULT fr;
+    UINT written;
+    int length = tftp->disk_stage_used;
+
+    if(tftp->disk_stage_used == 0)
+        return true;
+
+    if(tftp->mc_bitmap) // multicast blocks arrive out of order
+        f_lseek(&tftp->disk_file, tftp->disk_stage_offset);
+    fr = f_write(&tftp->disk_file, tftp->disk_stage, length, &written);
+    tftp->disk_stage_offset += length;
+    tftp->disk_stage_used = 0;
+    if(fr != FR_OK || written != length){
+        printf("tftp: failed to write to \"%s\": %s\n", tftp->disk_filename,
+                fr != FR_OK ? f_errmsg(fr) : "disk full");
+        tftp->completed = true;
+        tftp->success = false;
+        return false;
+    }
+
+    return true;
+}
+
+static void tftp_disk_stage_write(tftp_transfer_t *tftp, uint8_t *data, int size)
+{
+    int n;
+
+    // block sizes are not a multiple of the sector size; gather them up so
+    // FatFs can write whole clusters straight from our buffer, one
+    // multi-sector disk_write() each, without going through its sector
+    // buffer. The file starts on a cluster boundary, so all but the last
+    // write are cluster aligned (multicast, arriving out of order, aside).
+    while(size > 0){
+        n = tftp->disk_stage_size - tftp->disk_stage_used;
+        if(n > size)
+            n = size;
+        memcpy(tftp->disk_stage + tftp->disk_stage_used, data, n);
+        tftp->disk_stage_used += n;
+        data += n;
+        size -= n;
+        if(tftp->disk_stage_used == tftp->disk_stage_size)
+            if(!tftp_disk_stage_flush(tftp))
+                return;
+    }
+}
+
+static void tftp_get_write_data(tftp_transfer_t *tftp, uint8_t *data, int size)
+{
+    if(tftp->is_memory){
+        if(tftp->bytes_transferred + size > tftp->mem_length){
+            printf("tftp: data exceeds memory range (0x%lx bytes)\n", tftp->mem_length);
+            tftp->completed = true;
+            tftp->success = false;
+            return;
+        }
+        if(data != tftp->mem_buffer + tftp->bytes_transferred) // steered data is already in place
+            memcpy(tftp->mem_buffer + tftp->bytes_transferred, data, size);
+    }else if(tftp->cb_receive){
+        if(!tftp->cb_receive(tftp->cb_private, data, size)){
+            printf("tftp: receiver rejected data at offset %d\n", tftp->bytes_transferred);
+            tftp->completed = true;
+            tftp->success = false;
+        }
+    }else{
+        tftp_disk_stage_write(tftp, data, size);
+    }
+    tftp->bytes_transferred += size;
+}
+
 static void tftp_get_flush_data_and_ack(packet_sink_t *sink)
 {
     tftp_transfer_t *tftp = sink->sink_private;
     packet_t *packet;
     tftp_header_t *message;
     int size;
-    FRESULT fr;
 
     // send this FIRST so we can overlap receiving more data with writing to disk
     tftp_get_send_ack(sink);
@@ -329,17 +852,111 @@ static void tftp_get_flush_data_and_ack(packet_sink_t *sink)
         message = (tftp_header_t*)packet->data;
         size = packet->data_length - 4;
 
-        if(size > 0){
-            fr = f_write(&tftp->disk_file, message->payload.data.data, size, NULL);
-            tftp->bytes_transferred += size;
-            if(fr != FR_OK){
-                printf("tftp: failed to write to \"%s\": %s\n", tftp->disk_filename, f_errmsg(fr));
+        if(size > 0)
+            tftp_get_write_data(tftp, message->payload.data.data, size);
+        packet_free(packet);
+    }
+}
+
+// called from the ethernet driver before the data has been read from the
+// card: if this is a block in the current window, and we know where its
+// data will end up in memory, have the driver put it there directly.
+static uint8_t *tftp_client_steer_payload(packet_sink_t *sink, packet_t *packet, int length)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+    tftp_header_t *message = (tftp_header_t*)packet->data;
+    uint16_t rxblock;
+    uint32_t ahead;
+    int n;
+
+    // NET_STEER_PEEK covers the opcode and block number
+    if(tftp->is_put || !tftp->started || tftp->completed || tftp->mc_bitmap ||
+       ntohs(message->opcode) != tftp_op_data || length > tftp->block_size)
+        return NULL;
+
+    // blocks ahead of the expected one will land further on
+    rxblock = ntohs(message->payload.data.block_number);
+    for(n=0; n<tftp->window_size; n++)
+        if(rxblock == expected_block_number(tftp, n + 1))
+            break;
+    if(n == tftp->window_size)
+        return NULL;
+    ahead = n * tftp->block_size;
+
+    if(tftp->is_memory){
+        if(tftp->bytes_transferred + ahead + length > tftp->mem_length)
+            return NULL;
+        return tftp->mem_buffer + tftp->bytes_transferred + ahead;
+    }
+
+    if(tftp->cb_locate)
+        return tftp->cb_locate(tftp->cb_private, ahead, length);
+
+    return NULL; // disk writes are staged after the ACK is sent
+}
+
+static inline bool tftp_multicast_have(tftp_transfer_t *tftp, int index)
+{
+    return tftp->mc_bitmap[index >> 3] & (1 << (index & 7));
+}
+
+// RFC 2090: every client in the group hears every block the server sends,
+// whichever client asked for it, so blocks may arrive in any order. we
+// place each one at its final offset and note it in the bitmap; ACKing the
+// block before our first gap (when we are master) asks for the gap.
+static void tftp_multicast_process_data(packet_sink_t *sink, packet_t *packet)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+    tftp_header_t *message = (tftp_header_t*)packet->data;
+    uint16_t rxblock, expected;
+    uint32_t offset;
+    int size, index;
+
+    size = packet->data_length - 4;
+    rxblock = ntohs(message->payload.data.block_number);
+    expected = expected_block_number(tftp, 1);
+    index = (uint16_t)(rxblock - expected);
+    if(tftp->rollover_value == 1 && rxblock < expected)
+        index--; // block numbers skip 0 when they wrap
+    index += tftp->mc_next;
+    offset = index * tftp->block_size;
+
+    if(index < tftp->mc_blocks && !tftp_multicast_have(tftp, index) &&
+       size == (index == tftp->mc_blocks - 1 ? tftp->total_size - offset : tftp->block_size)){
+        if(tftp->is_memory){
+            if(offset + size > tftp->mem_length){
+                printf("tftp: data exceeds memory range (0x%lx bytes)\n", tftp->mem_length);
                 tftp->completed = true;
                 tftp->success = false;
+                return;
+            }
+            memcpy(tftp->mem_buffer + offset, message->payload.data.data, size);
+        }else{
+            // runs of consecutive blocks still go to disk in large writes
+            if(offset != tftp->disk_stage_offset + tftp->disk_stage_used){
+                if(!tftp_disk_stage_flush(tftp))
+                    return;
+                tftp->disk_stage_offset = offset;
             }
+            tftp_disk_stage_write(tftp, message->payload.data.data, size);
+        }
+        tftp->bytes_transferred += size;
+        tftp->mc_bitmap[index >> 3] |= 1 << (index & 7);
+        tftp->mc_received++;
+        tftp->retransmits_this_block = 0;
+
+        while(tftp->mc_next < tftp->mc_blocks && tftp_multicast_have(tftp, tftp->mc_next)){
+            tftp->last_block = expected_block_number(tftp, 1);
+            tftp->mc_next++;
+        }
+
+        if(tftp->mc_received == tftp->mc_blocks && !tftp->completed){
+            tftp->completed = true;
+            tftp->success = true;
         }
-        packet_free(packet);
     }
+
+    tftp_multicast_wait(sink);
 }
 
 static bool tftp_get_process_data(packet_sink_t *sink, packet_t *packet)
@@ -357,8 +974,15 @@ static bool tftp_get_process_data(packet_sink_t *sink, packet_t *packet)
         tftp->last_block = rxblock;
         tftp->retransmits_this_block = 0;
 
-        packet_queue_addtail(&tftp->data_queue, packet);
-        free_packet = false;
+        if(tftp->cb_receive || tftp->is_memory){
+            // placing data in memory is cheap, so do it immediately
+            if(size > 0)
+                tftp_get_write_data(tftp, packet->steered_data ? packet->steered_data : message->payload.data.data, size);
+        }else{
+            // defer disk writes until after we have sent the ACK
+            packet_queue_addtail(&tftp->data_queue, packet);
+            free_packet = false;
+        }
 
         if(!tftp->completed && size < tftp->block_size){
             // a short data block indicates success
@@ -368,8 +992,10 @@ static bool tftp_get_process_data(packet_sink_t *sink, packet_t *packet)
         }
     }
 
-    if(tftp->last_block == ((tftp->last_ack + tftp->window_size) & 0xffff))
+    if(tftp->last_block == ((tftp->last_ack + tftp->window_size) & 0xffff)){
+        window_completed(tftp);
         tftp_get_flush_data_and_ack(sink);
+    }
 
     return free_packet;
 }
@@ -402,6 +1028,8 @@ static void tftp_client_packet_received(packet_sink_t *sink, packet_t *packet)
         case tftp_op_data:
             if(tftp->is_put)
                 printf("tftp: unexpected DATA packet during put?\n");
+            else if(tftp->mc_bitmap)
+                tftp_multicast_process_data(sink, packet);
             else
                 free_packet = tftp_get_process_data(sink, packet);
             break;
@@ -437,7 +1065,9 @@ static void tftp_client_timer_expired(packet_sink_t *sink)
     if(tftp->completed)
         return;
 
-    if(!tftp->started){
+    if(!tftp->started || (tftp->mc_bitmap && !tftp->mc_master)){
+        // a multicast client which is not master asks again when the group
+        // goes quiet; the server answers with an OACK, perhaps making us master
         sink->timer = set_timer_ms(REQUEST_TIMEOUT);
         net_tx(tftp_create_request(sink));
     }else{
@@ -449,14 +1079,11 @@ static void tftp_client_timer_expired(packet_sink_t *sink)
 
     tftp->timeouts++;
     tftp->retransmits_this_block++;
+    tftp->window_lossy = true;
 }
 
-bool tftp_transfer(uint32_t tftp_server_ip, const char *tftp_filename, 
-        const char *disk_filename, bool is_put)
+static packet_sink_t *tftp_sink_alloc(uint32_t tftp_server_ip, const char *tftp_filename, bool is_put)
 {
-    FRESULT fr;
-    uint32_t start, taken, rate;
-    int uart_byte, reported_transferred;
     packet_sink_t *sink = packet_sink_alloc();
     tftp_transfer_t *tftp = malloc(sizeof(tftp_transfer_t));
     memset(tftp, 0, sizeof(tftp_transfer_t));
@@ -465,95 +1092,674 @@ bool tftp_transfer(uint32_t tftp_server_ip, const char *tftp_filename,
     sink->match_interface_local_ip = true;
     sink->match_ipv4_protocol = ip_proto_udp;
     sink->match_remote_ip = tftp_server_ip;
-    sink->match_local_port = 8192 + (gogoboot_read_timer() & 0x7fff);
+    // start somewhere random, then count up so concurrent transfers never collide
+    if(!tftp_next_port)
+        tftp_next_port = gogoboot_read_timer();
+    sink->match_local_port = 8192 + (tftp_next_port++ & 0x7fff);
     sink->sink_private = tftp;
     tftp->last_block = 0;
     tftp->block_size = 512;
     tftp->window_size = 1;
     tftp->is_put = is_put;
     tftp->tftp_filename = strdup(tftp_filename);
-    tftp->disk_filename = strdup(disk_filename);
+    if(!is_put)
+        tftp_client_gets++;
+
+    return sink;
+}
+
+static void tftp_sink_free(packet_sink_t *sink)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+
+    if(!tftp->is_put)
+        tftp_client_gets--;
+    packet_sink_free(sink);
+    free(tftp->tftp_filename);
+    free(tftp->disk_filename);
+    free(tftp->disk_stage);
+    free(tftp->put_cache);
+    free(tftp->mc_bitmap);
+    packet_queue_drain(&tftp->data_queue);
+    free(tftp);
+}
+
+static void tftp_start(packet_sink_t *sink)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+
+    tftp->start_time = gogoboot_read_timer();
+    sink->cb_packet_received = tftp_client_packet_received;
+    sink->cb_timer_expired = tftp_client_timer_expired;
+    sink->cb_steer_payload = tftp_client_steer_payload;
+    net_add_packet_sink(sink);
+    tftp_client_timer_expired(sink); // synthesise a timeout; triggers transmission of RRQ/WRQ
+    tftp->timeouts = 0; // fixup counts, since our "timeout" was synthetic
+    tftp->retransmits_this_block = 0; 
+    tftp->window_lossy = false;
+    tftp->overflow_mark = eth_overflow_count();
+    tftp->disk_writes_mark = disk_write_calls;
+    tftp->disk_sectors_mark = disk_write_sectors;
+}
+
+static void tftp_report_progress(tftp_transfer_t *tftp)
+{
+    if((tftp->bytes_transferred - tftp->reported_transferred) >= (256*1024) || 
+       (tftp->total_size && tftp->bytes_transferred >= tftp->total_size &&
+        tftp->reported_transferred < tftp->total_size)){
+        tftp->reported_transferred = tftp->bytes_transferred;
+        if(tftp->total_size){
+            if(tftp->reported_transferred > tftp->total_size)
+                tftp->reported_transferred = tftp->total_size;
+            printf("tftp: %d/%d KB", tftp->reported_transferred >> 10, tftp->total_size >> 10);
+        }else
+            printf("tftp: %d KB", tftp->reported_transferred >> 10);
+        if(tftp->timeouts)
+            printf(" (%d timeouts)", tftp->timeouts);
+        printf("\n");
+    }
+}
+
+// report, tidy up and free the transfer; returns true on success
+static bool tftp_finish(packet_sink_t *sink)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+    uint32_t taken, rate;
+    bool success;
+
+    // write out the final partial sector(s), even if the transfer failed
+    if(tftp->disk_filename && !tftp->is_put)
+        tftp_disk_stage_flush(tftp);
+
+    if(tftp->success){
+        printf("Transfer success.\n");
+        taken = gogoboot_read_timer() - tftp->start_time;
+        taken /= (TIMER_HZ/10); // taken is now in 10ths of a second
+        if(taken == 0)
+            taken = 1; // avoid div 0
+        rate = ((tftp->bytes_transferred / taken)*8) / 1000;
+        printf("Transferred %d bytes in %ld.%lds (%ld.%02ld Mbit/sec)\n",
+                tftp->bytes_transferred, taken/10, taken%10, rate/100, rate%100);
+    }else{
+        printf("Transfer FAILED!\n");
+    }
+
+    // only learn from transfers that negotiated a window of their own choosing
+    if(tftp->started && tftp->windows && !tftp->ring_shared)
+        window_history_update(sink);
+
+    // unregister the sink
+    net_remove_packet_sink(sink);
+    if(tftp->mc_sink){
+        net_remove_packet_sink(tftp->mc_sink);
+        packet_sink_free(tftp->mc_sink);
+        tftp->mc_sink = NULL;
+        net_multicast_leave(tftp->mc_group);
+    }
+
+    if(tftp->disk_filename){
+        f_close(&tftp->disk_file);
+        // includes anything else that wrote to disk meanwhile, eg a concurrent transfer
+        if(!tftp->is_put)
+            printf("Disk: %ld sectors in %ld writes\n",
+                    disk_write_sectors - tftp->disk_sectors_mark,
+                    disk_write_calls - tftp->disk_writes_mark);
+    }
+
+    success = tftp->success;
+    tftp_sink_free(sink);
+
+    return success;
+}
+
+// run the transfer to completion, returns true on success
+static bool tftp_run(packet_sink_t *sink)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+    int uart_byte;
+
+    tftp_start(sink);
+    printf("Transfer started: Press Q to abort\n");
+
+    while(!tftp->completed){
+        net_pump(); // this calls our callsbacks to make the transfer go
+        uart_byte = uart_read_byte();
+        if(uart_byte == 'q' || uart_byte == 'Q'){
+            printf("Aborted.\n");
+            break;
+        }
+        tftp_report_progress(tftp);
+    }
+
+    return tftp_finish(sink);
+}
+
+static bool tftp_task_poll(task_t *task)
+{
+    packet_sink_t *sink = task->task_private;
+    tftp_transfer_t *tftp = sink->sink_private;
+
+    task->progress = tftp->bytes_transferred;
+    if(!tftp->completed)
+        return false;
+
+    task->success = tftp_finish(sink);
+    return true;
+}
+
+// start the transfer as a job and return; the run-queue finishes it
+static bool tftp_background(packet_sink_t *sink, const char *description)
+{
+    task_t *task;
+
+    tftp_start(sink);
+    task = task_create(description, tftp_task_poll, sink);
+    printf("[%d] %s\n", task->id, description);
+
+    return true;
+}
+
+// "get 1.2.3.4:file" for the job list
+static char *tftp_describe(tftp_transfer_t *tftp, uint32_t tftp_server_ip, const char *local)
+{
+    char *d = malloc(strlen(tftp->tftp_filename) + strlen(local) + 32);
+
+    strcpy(d, tftp->is_put ? "tftp put " : "tftp get ");
+    net_format_ipv4(d + strlen(d), tftp_server_ip);
+    strcat(d, ":");
+    strcat(d, tftp->tftp_filename);
+    strcat(d, " ");
+    strcat(d, local);
+
+    return d;
+}
+
+static bool tftp_go(packet_sink_t *sink, uint32_t tftp_server_ip, const char *local, int flags)
+{
+    char *description;
+    bool success;
+
+    if(!(flags & TFTP_BACKGROUND))
+        return tftp_run(sink);
+
+    description = tftp_describe(sink->sink_private, tftp_server_ip, local);
+    success = tftp_background(sink, description);
+    free(description);
+
+    return success;
+}
+
+static int tftp_disk_stage_size(FIL *file)
+{
+    int cluster = file->obj.fs->csize * FF_MAX_SS;
+    int size;
+
+    if(cluster >= DISK_STAGE_MAX)
+        return DISK_STAGE_MAX;
+
+    size = cluster;
+    while(size < DISK_STAGE_MIN)
+        size += cluster;
+
+    return size;
+}
+
+// set up a transfer to or from a disk file; NULL if the file cannot be opened
+static packet_sink_t *tftp_file_sink(uint32_t tftp_server_ip, const char *tftp_filename,
+        const char *disk_filename, int flags)
+{
+    FRESULT fr;
+    bool is_put = (flags & TFTP_PUT) != 0;
+    packet_sink_t *sink = tftp_sink_alloc(tftp_server_ip, tftp_filename, is_put);
+    tftp_transfer_t *tftp = sink->sink_private;
+
+    tftp->multicast = (flags & TFTP_MULTICAST) != 0;
 
     if(is_put){
-        fr = f_open(&tftp->disk_file, tftp->disk_filename, FA_READ);
+        fr = f_open(&tftp->disk_file, disk_filename, FA_READ);
         tftp->total_size = f_size(&tftp->disk_file);
-    }else
-        fr = f_open(&tftp->disk_file, tftp->disk_filename, FA_WRITE | FA_CREATE_ALWAYS);
+    }else{
+        fr = f_open(&tftp->disk_file, disk_filename, FA_WRITE | FA_CREATE_ALWAYS);
+    }
 
     if(fr != FR_OK){
-        printf("tftp: failed to open \"%s\": %s\n", tftp->disk_filename, f_errmsg(fr));
-    }else{
-        printf("tftp: %s %d.%d.%d.%d:%s %s local file \"%s\"",
-                is_put ? "put" : "get",
-                (int)(tftp_server_ip >> 24 & 0xff),
-                (int)(tftp_server_ip >> 16 & 0xff),
-                (int)(tftp_server_ip >>  8 & 0xff),
-                (int)(tftp_server_ip       & 0xff),
-                tftp->tftp_filename,
-                is_put ? "from" : "to",
-                tftp->disk_filename);
-        if(is_put)
-            printf(" %d bytes", tftp->total_size);
-        putchar('\n');
-
-        start = gogoboot_read_timer();
-        sink->cb_packet_received = tftp_client_packet_received;
-        sink->cb_timer_expired = tftp_client_timer_expired;
-        net_add_packet_sink(sink);
-        tftp_client_timer_expired(sink); // synthesise a timeout; triggers transmission of RRQ/WRQ
-        tftp->timeouts = 0; // fixup counts, since our "timeout" was synthetic
-        tftp->retransmits_this_block = 0; 
+        printf("tftp: failed to open \"%s\": %s\n", disk_filename, f_errmsg(fr));
+        tftp_sink_free(sink);
+        return NULL;
+    }
 
-        printf("Transfer started: Press Q to abort\n");
+    if(!is_put){
+        tftp->disk_stage_size = tftp_disk_stage_size(&tftp->disk_file);
+        tftp->disk_stage = malloc(tftp->disk_stage_size);
+    }
 
-        reported_transferred = 0;
-        while(!tftp->completed){
-            net_pump(); // this calls our callsbacks to make the transfer go
-            uart_byte = uart_read_byte();
-            if(uart_byte == 'q' || uart_byte == 'Q'){
-                printf("Aborted.\n");
-                break;
-            }
-            if((tftp->bytes_transferred - reported_transferred) >= (256*1024) || 
-               (tftp->total_size && tftp->bytes_transferred >= tftp->total_size)){
-                reported_transferred = tftp->bytes_transferred;
-                if(tftp->total_size){
-                    if(reported_transferred > tftp->total_size)
-                        reported_transferred = tftp->total_size;
-                    printf("tftp: %d/%d KB", reported_transferred >> 10, tftp->total_size >> 10);
-                }else
-                    printf("tftp: %d KB", reported_transferred >> 10);
-                if(tftp->timeouts)
-                    printf(" (%d timeouts)", tftp->timeouts);
-                printf("\n");
-            }
+    tftp->disk_filename = strdup(disk_filename); // tftp_finish() closes the file when this is set
+
+    printf("tftp: %s %d.%d.%d.%d:%s %s local file \"%s\"",
+            is_put ? "put" : "get",
+            (int)(tftp_server_ip >> 24 & 0xff),
+            (int)(tftp_server_ip >> 16 & 0xff),
+            (int)(tftp_server_ip >>  8 & 0xff),
+            (int)(tftp_server_ip       & 0xff),
+            tftp->tftp_filename,
+            is_put ? "from" : "to",
+            tftp->disk_filename);
+    if(is_put)
+        printf(" %d bytes", tftp->total_size);
+    if(tftp->multicast)
+        printf(" by multicast");
+    putchar('\n');
+
+    return sink;
+}
+
+bool tftp_transfer_file(uint32_t tftp_server_ip, const char *tftp_filename,
+        const char *disk_filename, int flags)
+{
+    packet_sink_t *sink = tftp_file_sink(tftp_server_ip, tftp_filename, disk_filename, flags);
+
+    if(!sink)
+        return false;
+
+    return tftp_go(sink, tftp_server_ip, disk_filename, flags);
+}
+
+bool tftp_receive(uint32_t tftp_server_ip, const char *tftp_filename,
+        tftp_receive_cb_t cb_receive, tftp_locate_cb_t cb_locate, void *cb_private)
+{
+    packet_sink_t *sink = tftp_sink_alloc(tftp_server_ip, tftp_filename, false);
+    tftp_transfer_t *tftp = sink->sink_private;
+
+    tftp->cb_receive = cb_receive;
+    tftp->cb_locate = cb_locate;
+    tftp->cb_private = cb_private;
+
+    printf("tftp: get %d.%d.%d.%d:%s to memory\n",
+            (int)(tftp_server_ip >> 24 & 0xff),
+            (int)(tftp_server_ip >> 16 & 0xff),
+            (int)(tftp_server_ip >>  8 & 0xff),
+            (int)(tftp_server_ip       & 0xff),
+            tftp->tftp_filename);
+
+    return tftp_run(sink);
+}
+
+// set up a transfer to or from memory; NULL if the range is not writable
+static packet_sink_t *tftp_memory_sink(uint32_t tftp_server_ip, const char *tftp_filename,
+        uint32_t address, uint32_t length, int flags)
+{
+    const char *range_err;
+    packet_sink_t *sink;
+    tftp_transfer_t *tftp;
+    bool is_put = (flags & TFTP_PUT) != 0;
+
+    if(!is_put){
+        range_err = check_writable_range(address, length, false);
+        if(range_err){
+            printf("tftp: address range error: %s\n", range_err);
+            return NULL;
         }
+    }
 
-        if(tftp->success){
-            printf("Transfer success.\n");
-            taken = gogoboot_read_timer() - start;
-            taken /= (TIMER_HZ/10); // taken is now in 10ths of a second
-            if(taken == 0)
-                taken = 1; // avoid div 0
-            rate = ((tftp->bytes_transferred / taken)*8) / 1000;
-            printf("Transferred %d bytes in %ld.%lds (%ld.%02ld Mbit/sec)\n",
-                    tftp->bytes_transferred, taken/10, taken%10, rate/100, rate%100);
-        }else{
-            printf("Transfer FAILED!\n");
+    sink = tftp_sink_alloc(tftp_server_ip, tftp_filename, is_put);
+    tftp = sink->sink_private;
+    tftp->is_memory = true;
+    tftp->mem_buffer = (uint8_t*)address;
+    tftp->mem_length = length;
+    tftp->multicast = (flags & TFTP_MULTICAST) != 0;
+    if(is_put)
+        tftp->total_size = length;
+
+    printf("tftp: %s %d.%d.%d.%d:%s %s memory at 0x%lx",
+            is_put ? "put" : "get",
+            (int)(tftp_server_ip >> 24 & 0xff),
+            (int)(tftp_server_ip >> 16 & 0xff),
+            (int)(tftp_server_ip >>  8 & 0xff),
+            (int)(tftp_server_ip       & 0xff),
+            tftp->tftp_filename,
+            is_put ? "from" : "to",
+            address);
+    if(is_put)
+        printf(" %ld bytes", length);
+    if(tftp->multicast)
+        printf(" by multicast");
+    putchar('\n');
+
+    return sink;
+}
+
+bool tftp_transfer_memory(uint32_t tftp_server_ip, const char *tftp_filename,
+        uint32_t address, uint32_t length, int flags)
+{
+    packet_sink_t *sink = tftp_memory_sink(tftp_server_ip, tftp_filename, address, length, flags);
+    char where[12];
+
+    if(!sink)
+        return false;
+
+    where[0] = '@';
+    where[1] = '0';
+    where[2] = 'x';
+    for(int i=0; i<8; i++)
+        where[3+i] = "0123456789abcdef"[(address >> (28 - 4*i)) & 0xf];
+    where[11] = 0;
+
+    return tftp_go(sink, tftp_server_ip, where, flags);
+}
+
+// run several gets side by side, each with its own sink and port; the
+// windows are cut so that together they fit the card's receive ring
+bool tftp_get_many(uint32_t tftp_server_ip, const tftp_request_t *requests, int count)
+{
+    packet_sink_t **sinks;
+    tftp_transfer_t *tftp;
+    uint32_t start, taken, rate;
+    int uart_byte, running, transfers = 0, succeeded = 0, total_size, transferred, bytes, reported_transferred = 0;
+    bool success = true;
+
+    sinks = malloc(count * sizeof(packet_sink_t*));
+
+    // set them all up before starting any, so each asks for its share of the ring
+    for(int i=0; i<count; i++){
+        if(requests[i].disk_filename)
+            sinks[transfers] = tftp_file_sink(tftp_server_ip, requests[i].tftp_filename, requests[i].disk_filename, 0);
+        else
+            sinks[transfers] = tftp_memory_sink(tftp_server_ip, requests[i].tftp_filename,
+                    requests[i].address, requests[i].length, 0);
+        if(sinks[transfers])
+            transfers++;
+        else
+            success = false;
+    }
+
+    start = gogoboot_read_timer();
+    for(int i=0; i<transfers; i++)
+        tftp_start(sinks[i]);
+
+    printf("%d transfers started: Press Q to abort\n", transfers);
+
+    do{
+        net_pump();
+        uart_byte = uart_read_byte();
+        if(uart_byte == 'q' || uart_byte == 'Q'){
+            printf("Aborted.\n");
+            break;
         }
 
-        // close the file
+        running = 0;
+        transferred = total_size = 0;
+        for(int i=0; i<transfers; i++){
+            tftp = sinks[i]->sink_private;
+            if(!tftp->completed)
+                running++;
+            transferred += tftp->bytes_transferred;
+            total_size += tftp->total_size;
+        }
+        if(transferred - reported_transferred >= (256*1024)){
+            reported_transferred = transferred;
+            printf("tftp: %d/%d KB in %d transfers\n", transferred >> 10, total_size >> 10, running);
+        }
+    }while(running);
+
+    taken = gogoboot_read_timer() - start;
+
+    transferred = 0;
+    for(int i=0; i<transfers; i++){
+        tftp = sinks[i]->sink_private;
+        bytes = tftp->bytes_transferred; // tftp_finish() frees tftp
+        if(tftp_finish(sinks[i])){
+            transferred += bytes;
+            succeeded++;
+        }else
+            success = false;
+    }
+    free(sinks);
+
+    taken /= (TIMER_HZ/10); // taken is now in 10ths of a second
+    if(taken == 0)
+        taken = 1; // avoid div 0
+    rate = ((transferred / taken)*8) / 1000;
+    printf("%s: %d bytes in %d of %d files in %ld.%lds (%ld.%02ld Mbit/sec aggregate)\n",
+            success ? "All transfers succeeded" : "Some transfers FAILED",
+            transferred, succeeded, count, taken/10, taken%10, rate/100, rate%100);
+
+    return success;
+}
+
+/* --- server --- */
+
+// Serves read requests (RRQ) on port 69, from the FAT volumes or from memory
+// named "mem/ADDRESS/LENGTH". Each transfer gets its own sink and runs from
+// net_pump() alongside whatever the console is doing; the sending side is
+// shared with tftpput.
+
+static packet_sink_t *tftp_server_sink = NULL;
+static int tftp_server_active = 0;
+
+static void tftp_server_finish(packet_sink_t *sink)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+
+    tftp->completed = true;
+    // we cannot free the sink from inside its receive callback; do it from the timer
+    sink->timer = set_timer_ticks(1);
+}
+
+static void tftp_server_timer_expired(packet_sink_t *sink)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+    uint32_t ip = sink->match_remote_ip;
+
+    if(!tftp->completed){
+        if(tftp->retransmits_this_block > 20){
+            tftp->success = false;
+            tftp_server_finish(sink);
+            return;
+        }
+        if(tftp->oack_pending)
+            net_tx(tftp_create_options_ack(sink));
+        else
+            tftp_put_send_data(sink, 1);
+        sink->timer = set_timer_ms(tftp->oack_pending ? REQUEST_TIMEOUT : DATA_TIMEOUT);
+        tftp->timeouts++;
+        tftp->retransmits_this_block++;
+        return;
+    }
+
+    printf("tftpd: %s %d.%d.%d.%d:%s (%d bytes)\n",
+            tftp->success ? "sent" : "FAILED sending",
+            (int)(ip >> 24 & 0xff), (int)(ip >> 16 & 0xff),
+            (int)(ip >>  8 & 0xff), (int)(ip       & 0xff),
+            tftp->tftp_filename,
+            tftp->bytes_transferred > tftp->total_size ? tftp->total_size : tftp->bytes_transferred);
+
+    net_remove_packet_sink(sink);
+    if(!tftp->is_memory)
         f_close(&tftp->disk_file);
+    tftp_sink_free(sink);
+    tftp_server_active--;
+}
 
-        // unregister the sink
-        net_remove_packet_sink(sink);
+static void tftp_server_packet_received(packet_sink_t *sink, packet_t *packet)
+{
+    tftp_transfer_t *tftp = sink->sink_private;
+    tftp_header_t *message = (tftp_header_t*)packet->data;
+
+    if(!tftp->completed){
+        switch(ntohs(message->opcode)){
+            case tftp_op_ack:
+                tftp->oack_pending = false;
+                tftp_put_process_ack(sink, packet);
+                if(tftp->completed)
+                    tftp_server_finish(sink);
+                break;
+            case tftp_op_err:
+                tftp->success = false;
+                tftp_server_finish(sink);
+                break;
+            default:
+                break;
+        }
     }
 
-    packet_sink_free(sink);
-    free(tftp->tftp_filename);
-    free(tftp->disk_filename);
-    packet_queue_drain(&tftp->data_queue);
-    free(tftp);
+    packet_free(packet);
+}
+
+// reply to a request without setting up a transfer
+static void tftp_server_reject(packet_t *request, uint16_t error_code, const char *error_message)
+{
+    int len = strlen(error_message) + 1;
+    packet_t *packet = packet_create_udp(ntohl(request->ipv4->source_ip), ntohs(request->udp->source_port),
+            8192 + (gogoboot_read_timer() & 0x7fff), len + 4);
+    if(!packet)
+        return;
+    tftp_header_t *message = (tftp_header_t*)packet->data;
+
+    message->opcode = htons(tftp_op_err);
+    message->payload.error.error_code = htons(error_code);
+    memcpy(message->payload.error.error_message, error_message, len);
+    net_tx(packet);
+}
+
+static bool tftp_server_open(tftp_transfer_t *tftp)
+{
+    const char *p;
+    uint32_t address, length;
+    FRESULT fr;
+
+    if(!strncasecmp(tftp->tftp_filename, "mem/", 4)){
+        p = tftp->tftp_filename + 4;
+        address = parse_uint32(p, &p);
+        if(*p != '/')
+            return false;
+        length = parse_uint32(p+1, &p);
+        if(*p)
+            return false;
+        // RAM only: anything else may be device registers, or not decoded at all
+        if(length > ram_size || address > ram_size - length)
+            return false;
+        tftp->is_memory = true;
+        tftp->mem_buffer = (uint8_t*)address;
+        tftp->mem_length = length;
+        tftp->total_size = tftp->mem_length;
+        return true;
+    }
 
+    tftp->disk_filename = strdup(tftp->tftp_filename);
+    fr = f_open(&tftp->disk_file, tftp->disk_filename, FA_READ);
+    if(fr != FR_OK)
+        return false;
+    tftp->total_size = f_size(&tftp->disk_file);
     return true;
 }
+
+static void tftp_server_request(packet_sink_t *server, packet_t *packet)
+{
+    tftp_header_t *message = (tftp_header_t*)packet->data;
+    char *ptr, *end, *filename, *mode, *opt, *val;
+    packet_sink_t *sink;
+    tftp_transfer_t *tftp;
+    int val_int;
+
+    if(packet->data_length < 4)
+        goto done;
+
+    if(ntohs(message->opcode) != tftp_op_rrq){
+        if(ntohs(message->opcode) == tftp_op_wrq)
+            tftp_server_reject(packet, 2, "Read only server");
+        goto done;
+    }
+
+    // filename, mode, then option/value pairs, all NUL terminated
+    ptr = (char*)message->payload.raw;
+    end = (char*)packet->data + packet->data_length;
+    if(end[-1] != 0)
+        goto done;
+    filename = ptr;
+    ptr += strlen(ptr) + 1;
+    if(ptr >= end)
+        goto done;
+    mode = ptr;
+    ptr += strlen(ptr) + 1;
+
+    if(strcasecmp(mode, "octet")){
+        tftp_server_reject(packet, 0, "Only octet mode is supported");
+        goto done;
+    }
+
+    sink = tftp_sink_alloc(ntohl(packet->ipv4->source_ip), filename, true);
+    sink->match_remote_port = ntohs(packet->udp->source_port);
+    tftp = sink->sink_private;
+    tftp->started = true;
+
+    if(!tftp_server_open(tftp)){
+        tftp_server_reject(packet, 1, "File not found");
+        tftp_sink_free(sink);
+        goto done;
+    }
+
+    while(ptr < end){
+        opt = ptr;
+        ptr += strlen(ptr) + 1;
+        if(ptr >= end)
+            break;
+        val = ptr;
+        ptr += strlen(ptr) + 1;
+        val_int = atoi(val);
+        if(!strcasecmp(opt, "blksize") && val_int >= 8){
+            tftp->block_size = (val_int > BLOCK_SIZE) ? BLOCK_SIZE : val_int;
+            tftp->server_options |= SERVER_OPT_BLKSIZE;
+        }else if(!strcasecmp(opt, "windowsize") && val_int >= 1){
+            tftp->window_size = (val_int > window_limit(true)) ? window_limit(true) : val_int;
+            tftp->server_options |= SERVER_OPT_WINDOWSIZE;
+        }else if(!strcasecmp(opt, "tsize")){
+            tftp->server_options |= SERVER_OPT_TSIZE;
+        }else if(!strcasecmp(opt, "rollover") && (val_int == 0 || val_int == 1)){
+            tftp->rollover_value = val_int;
+            tftp->server_options |= SERVER_OPT_ROLLOVER;
+        }
+    }
+    tftp->oack_pending = (tftp->server_options != 0);
+
+    sink->cb_packet_received = tftp_server_packet_received;
+    sink->cb_timer_expired = tftp_server_timer_expired;
+    net_add_packet_sink(sink);
+    tftp_server_active++;
+
+    if(tftp->oack_pending){
+        // the client's ACK of block 0 starts the data flowing
+        net_tx(tftp_create_options_ack(sink));
+        sink->timer = set_timer_ms(REQUEST_TIMEOUT);
+    }else
+        tftp_put_send_data(sink, tftp->window_size);
+
+done:
+    packet_free(packet);
+}
+
+void tftp_server_enable(bool enable)
+{
+    if(enable && !tftp_server_sink){
+        tftp_server_sink = packet_sink_alloc();
+        tftp_server_sink->match_interface_local_ip = true;
+        tftp_server_sink->match_ipv4_protocol = ip_proto_udp;
+        tftp_server_sink->match_local_port = 69;
+        tftp_server_sink->cb_packet_received = tftp_server_request;
+        net_add_packet_sink(tftp_server_sink);
+    }else if(!enable && tftp_server_sink){
+        // transfers already under way are left to finish
+        net_remove_packet_sink(tftp_server_sink);
+        packet_sink_free(tftp_server_sink);
+        tftp_server_sink = NULL;
+    }
+}
+
+bool tftp_server_enabled(void)
+{
+    return tftp_server_sink != NULL;
+}
+
+int tftp_server_transfers(void)
+{
+    return tftp_server_active;
+}
@@ -25,6 +25,28 @@ void q40_rtc_write_nvram(int offset, uint8_t value)
         *Q40_RTC_NVRAM(offset) = value;
 }
 
+/* we keep to the top of the NVRAM, out of the way of other software */
+#define GOGOBOOT_NVRAM_SIZE 32
+#define GOGOBOOT_NVRAM_BASE (Q40_RTC_NVRAM_SIZE - GOGOBOOT_NVRAM_SIZE)
+
+int rtc_nvram_size(void)
+{
+    return GOGOBOOT_NVRAM_SIZE;
+}
+
+uint8_t rtc_nvram_read(int offset)
+{
+    if(offset >= 0 && offset < GOGOBOOT_NVRAM_SIZE)
+        return q40_rtc_read_nvram(GOGOBOOT_NVRAM_BASE + offset);
+    return 0xff;
+}
+
+void rtc_nvram_write(int offset, uint8_t value)
+{
+    if(offset >= 0 && offset < GOGOBOOT_NVRAM_SIZE)
+        q40_rtc_write_nvram(GOGOBOOT_NVRAM_BASE + offset, value);
+}
+
 static uint8_t q40_rtc_read_control(void)
 {
     return *Q40_RTC_REGISTER(0);